@@ -7,51 +7,304 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "mymalloc.h"
 
+#define MAX_WORKLOADF_THREADS 8 // workloadF is run with 1 up to this many threads (capped by the number of cores)
+#define WORKLOADF_LIVE_BLOCKS 4 // blocks each workloadF thread holds at once
+#define WORKLOADG_VECTORS 4 // vectors grown side by side in workloadG
+#define WORKLOADG_STEP 24 // bytes each vector grows by per realloc()
+#define REQUEST_OBJECTS 48 // objects workloadH and workloadI allocate while handling one request
+#define WORKLOADK_LIVE_BLOCKS 512 // blocks workloadK keeps live while it frees and replaces them
+#define NUM_POLICIES 3 // placement policies memgrind can compare, see MYMALLOC_BEST_FIT
+
+#define MAX_LATENCY_SAMPLES (1 << 22) // per-operation latencies kept per workload, later operations are not sampled
+
+/**
+ * Workload describes one memgrind workload to the harness: its name, the function running it once and
+ * the parameter (usually an iteration count) handed to that function, which can be changed with -p.
+ */
+typedef struct Workload {
+    char name; // 'A' to 'K', or 'R'
+    long long (*run)(int); // runs the workload once and returns its runtime in nanoseconds
+    int param; // argument for run
+} Workload;
+
+/**
+ * Result holds everything the harness measured for one workload (and thread count, for workloadF).
+ */
+typedef struct Result {
+    char name;
+    int policy; // placement policy the workload ran with
+    int threads;
+    int param;
+    int runs;
+    long opsPerRun; // malloc(), free() and realloc() calls in one run
+    double meanMicroseconds; // mean runtime of one run
+    double opsPerSecond;
+    long long p50; // per-operation latency percentiles in nanoseconds
+    long long p99;
+    long long p999;
+    long inPlace; // workloadG only: realloc() calls that kept the same pointer
+    size_t peakFootprint; // trace replay only: most memory the allocator held, see mymalloc_footprint()
+    size_t peakLive; // trace replay only: most bytes the trace had handed out at once
+    double fragmentation; // trace replay: share of the peak footprint not needed for the peak live bytes, workloadK: see MallocStats
+    size_t largestFree; // workloadK only: largest request the fragmented heap could serve without growing
+} Result;
+
+/**
+ * ReplayOp is one call of a recorded trace, prepared for replay. Recorded pointers are replaced by slots,
+ * indices into the array of blocks the replay currently holds, so replaying needs no pointer lookups.
+ */
+typedef struct ReplayOp {
+    char op; // TRACE_MALLOC, TRACE_ALIGNED_ALLOC, TRACE_FREE or TRACE_REALLOC
+    unsigned int slot; // block the call hands out, frees or resizes
+    size_t size; // requested size
+    size_t alignment; // TRACE_ALIGNED_ALLOC only
+} ReplayOp;
+
+/**
+ * Replay is a trace loaded by loadTrace(), along with the blocks it holds while it is replayed.
+ */
+typedef struct Replay {
+    ReplayOp *ops;
+    long numOps;
+    long numSkipped; // frees of blocks handed out before the trace started, which cannot be replayed
+    unsigned int numSlots; // most blocks live at once
+    void **blocks; // block held in each slot
+    size_t *sizes; // requested size of the block in each slot, kept up to date while measuring footprint
+    size_t liveBytes;
+} Replay;
+
+static int workloadFThreads = 1; // threads workloadF runs with
+static long workloadGInPlace = 0; // realloc() calls in workloadG that did not move the vector
+static size_t workloadKLargestFree = 0; // largest free heap block at the end of the last workloadK run
+static double workloadKFragmentation = 0;
+static int comparingPolicies = 0; // whether the workloads are run once per placement policy (-P)
+static const char *policyNames[NUM_POLICIES] = { "best-fit", "first-fit", "next-fit" }; // by MYMALLOC_ value
+
+static __thread long threadOps = 0; // operations issued by the calling thread
+static long finishedThreadOps = 0; // operations issued by workloadF threads that have finished
+static int recordLatency = 0; // whether operations are being timed one by one
+static unsigned int *latencySamples = NULL; // per-operation latencies in nanoseconds
+static long numLatencySamples = 0;
+static Replay replay; // trace replayed as workload R
+static int measureFootprint = 0; // whether replays track live bytes and the allocator's footprint
+static Result *footprintResult = NULL; // where replays store peak footprint, live bytes and fragmentation
+
+/**
+ * Reads the monotonic clock, which unlike the time of day never jumps and has nanosecond resolution.
+ * @param[out] current reading in nanoseconds
+ */
+long long nowNanoseconds () {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Stores the latency of one operation if the harness is sampling latencies and there is room left.
+ * @param[in] latency in nanoseconds
+ */
+void addLatencySample (long long nanoseconds) {
+    long index = __atomic_fetch_add(&numLatencySamples, 1, __ATOMIC_RELAXED);
+
+    if (index < MAX_LATENCY_SAMPLES) {
+        latencySamples[index] = (unsigned int) nanoseconds;
+    }
+}
+
+/**
+ * Wrappers the workloads' malloc(), free() and realloc() calls are routed through, so the harness can
+ * count every operation and, while sampling latencies, time each one.
+ */
+void* timedMalloc (size_t size, char* file, int line) {
+    long long start = 0;
+    void *ptr = NULL;
+
+    threadOps++;
+    if (!recordLatency) {
+        return mymalloc(size, file, line);
+    }
+
+    start = nowNanoseconds();
+    ptr = mymalloc(size, file, line);
+    addLatencySample(nowNanoseconds() - start);
+    return ptr;
+}
+
+void timedFree (void* ptr, char* file, int line) {
+    long long start = 0;
+
+    threadOps++;
+    if (!recordLatency) {
+        myfree(ptr, file, line);
+        return;
+    }
+
+    start = nowNanoseconds();
+    myfree(ptr, file, line);
+    addLatencySample(nowNanoseconds() - start);
+}
+
+void* timedRealloc (void* ptr, size_t size, char* file, int line) {
+    long long start = 0;
+
+    threadOps++;
+    if (!recordLatency) {
+        return myrealloc(ptr, size, file, line);
+    }
+
+    start = nowNanoseconds();
+    ptr = myrealloc(ptr, size, file, line);
+    addLatencySample(nowNanoseconds() - start);
+    return ptr;
+}
+
+void* timedAlignedAlloc (size_t alignment, size_t size, char* file, int line) {
+    long long start = 0;
+    void *ptr = NULL;
+
+    threadOps++;
+    if (!recordLatency) {
+        return myaligned_alloc(alignment, size, file, line);
+    }
+
+    start = nowNanoseconds();
+    ptr = myaligned_alloc(alignment, size, file, line);
+    addLatencySample(nowNanoseconds() - start);
+    return ptr;
+}
+
+/**
+ * Stores the latency of a batch call as that of each of its blocks: its time divided by the number of blocks,
+ * once per block, so a batch weighs in the percentiles as the operations it stands for.
+ * @param[in] latency of the whole call in nanoseconds
+ * @param[in] number of blocks in the batch
+ */
+void addBatchLatencySamples (long long nanoseconds, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        addLatencySample(nanoseconds / (long long) count);
+    }
+}
+
+/* a batch counts as one operation per block, and each block as a share of the call's time */
+int timedMallocBatch (size_t size, size_t count, void **ptrs, char* file, int line) {
+    long long start = 0;
+    int allocated = 0;
+
+    threadOps += (long) count;
+    if (!recordLatency) {
+        return mymalloc_batch(size, count, ptrs, file, line);
+    }
+
+    start = nowNanoseconds();
+    allocated = mymalloc_batch(size, count, ptrs, file, line);
+    addBatchLatencySamples(nowNanoseconds() - start, count);
+    return allocated;
+}
+
+void timedFreeBatch (void **ptrs, size_t count, char* file, int line) {
+    long long start = 0;
+
+    threadOps += (long) count;
+    if (!recordLatency) {
+        myfree_batch(ptrs, count, file, line);
+        return;
+    }
+
+    start = nowNanoseconds();
+    myfree_batch(ptrs, count, file, line);
+    addBatchLatencySamples(nowNanoseconds() - start, count);
+}
+
+void* timedArenaAlloc (Arena *arena, size_t size) {
+    long long start = 0;
+    void *ptr = NULL;
+
+    threadOps++;
+    if (!recordLatency) {
+        return (arena_alloc)(arena, size);
+    }
+
+    start = nowNanoseconds();
+    ptr = (arena_alloc)(arena, size);
+    addLatencySample(nowNanoseconds() - start);
+    return ptr;
+}
+
+void timedArenaReset (Arena *arena) {
+    long long start = 0;
+
+    threadOps++;
+    if (!recordLatency) {
+        (arena_reset)(arena);
+        return;
+    }
+
+    start = nowNanoseconds();
+    (arena_reset)(arena);
+    addLatencySample(nowNanoseconds() - start);
+}
+
+/* every workload below goes through the wrappers */
+#undef malloc
+#undef free
+#undef realloc
+#undef aligned_alloc
+#undef malloc_batch
+#undef free_batch
+#define malloc(x) timedMalloc(x, __FILE__, __LINE__)
+#define free(x) timedFree(x, __FILE__, __LINE__)
+#define realloc(p, x) timedRealloc(p, x, __FILE__, __LINE__)
+#define aligned_alloc(a, x) timedAlignedAlloc(a, x, __FILE__, __LINE__)
+#define malloc_batch(x, n, ptrs) timedMallocBatch(x, n, ptrs, __FILE__, __LINE__)
+#define free_batch(ptrs, n) timedFreeBatch(ptrs, n, __FILE__, __LINE__)
+#define arena_alloc(a, x) timedArenaAlloc(a, x)
+#define arena_reset(a) timedArenaReset(a)
+
 /**
  * Memgrind workload function that will malloc() 1 byte and immediately free it. 
- * Calculates runtime using gettimeofday from sys/time.h library.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
  * @param[in] number of iterations workloadA should run
- * @param[out] runtime for workloadA
+ * @param[out] runtime for workloadA in nanoseconds
  */ 
-long workloadA (int numAIterations) {
-    struct timeval start;
-    struct timeval end;
+long long workloadA (int numAIterations) {
+    long long start = 0; // monotonic clock reading when the workload starts
     char* c; // one byte that will be malloced and immediately freed
 
     if (numAIterations < 0) {
         return 0;
     }
 
-    gettimeofday(&start, NULL); // getting current time of day
+    start = nowNanoseconds(); // reading the monotonic clock
     for (int i = 0; i < numAIterations; i++) {
         c = malloc(1);
         free(c);
     }
-    gettimeofday(&end, NULL); // store end time after running loop
-
-    return (end.tv_usec - start.tv_usec); // returning end time - start time in microseconds
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
 }
 
 /**
  * Memgrind workload function that will malloc() 1 byte and store each pointer
  * in an array. Then will free all pointers in that array subsequently.
- * Calculates runtime using gettimeofday from sys/time.h library.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
  * @param[in] number of iterations workloadB should run
- * @param[out] runtime for workloadB
+ * @param[out] runtime for workloadB in nanoseconds
  */ 
-long workloadB (int numBIterations) {
-    struct timeval start;
-    struct timeval end;
+long long workloadB (int numBIterations) {
+    long long start = 0; // monotonic clock reading when the workload starts
     char* pointers[numBIterations]; // array storing pointers to individual bytes
 
     if (numBIterations < 0) {
         return 0;
     }
 
-    gettimeofday(&start, NULL); // getting current time of day
+    start = nowNanoseconds(); // reading the monotonic clock
     // malloc 120 pointers to one byte
     for (int i = 0; i < numBIterations; i++) {
         pointers[i] = malloc(1);
@@ -61,28 +314,25 @@ long workloadB (int numBIterations) {
     for (int i = 0; i < numBIterations; i++) {
         free(pointers[i]);
     }
-    gettimeofday(&end, NULL); // store end time after running malloc/free
-
-    return (end.tv_usec - start.tv_usec); // returning end time - start time in microseconds
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
 }
 
 /**
  * Memgrind workload function that will randomly choose between a 1 byte malloc() or free(). Ensures that free() will only be called
  * if there are malloced pointers already stored in array. Keeps track of a max limit of pointers able to be malloced.
- * Calculates runtime using gettimeofday from sys/time.h library.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
  * @param[in] number of iterations workloadC should run
- * @param[out] runtime for workloadC
+ * @param[out] runtime for workloadC in nanoseconds
  */
-long workloadC (int numCIterations) {
-    struct timeval start;
-    struct timeval end;
+long long workloadC (int numCIterations) {
+    long long start = 0; // monotonic clock reading when the workload starts
     char* pointers[120]; // array storing pointers to individual bytes
     int pointersIndex = 0; // this index should not exceed 120 (max: 119)
     int currMalloced = 0; // keeps track of the number of currently malloced pointers to check if free can be called
     int randomNum = 0; // malloc = 0, free = 1
     int freeIndex = 0; // next pointer to be freed in array
 
-    gettimeofday(&start, NULL); // getting current time of day
+    start = nowNanoseconds(); // reading the monotonic clock
     for (int i = 0; i < numCIterations; i++) {
         // within the for loop, generate a random number and decide between malloc or free
         randomNum = (rand() % 2); // randomNum will always be 0 or 1 since those are the only possible remainders when modulo 2
@@ -113,29 +363,26 @@ long workloadC (int numCIterations) {
             }
         }
     }
-    gettimeofday(&end, NULL); // store end time after running malloc/free
-
-    return (end.tv_usec - start.tv_usec); // returning end time - start time in microseconds
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
 }
 
 /**
  * Memgrind workload function that will malloc() 1 byte and immediately free it, similar to that of workload A. It also has 
  * an added feature that will randomly choose two arbitrary numbers and see if they are equal, which then 
  * will try to free an invalid pointer. This feature showcases how free() gracefully handles invalid pointers.
- * Calculates runtime using gettimeofday from sys/time.h library.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
  * @param[in] number of iterations workloadD should run
- * @param[out] runtime for workloadD
+ * @param[out] runtime for workloadD in nanoseconds
  */ 
-long workloadD (int numDIterations) {
-    struct timeval start;
-    struct timeval end;
+long long workloadD (int numDIterations) {
+    long long start = 0; // monotonic clock reading when the workload starts
     char* c; // one byte that will be malloced and immediately freed
 
     /* using two random numbres limits the number of times they will be equal to keep the number of errors printed to a moderate amount */
     int randomNum1 = 0;
     int randomNum2 = 0;
 
-    gettimeofday(&start, NULL); // getting current time of day
+    start = nowNanoseconds(); // reading the monotonic clock
     for (int i = 0; i < numDIterations; i++) {
         randomNum1 = (rand() % 5);
         randomNum2 = (rand() % 5);
@@ -147,109 +394,1151 @@ long workloadD (int numDIterations) {
         }
 
     }
-    gettimeofday(&end, NULL); // store end time after running loop
-
-    return (end.tv_usec - start.tv_usec); // returning end time - start time in microseconds
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
 }
 
 /**
  * Memgrind workload function that showcases a multitude of malloc() and free() features. It will malloc() three chunks of 200 bytes (as available in memory) at a time, 
  * and then will free two adjacent blocks at a time. This will showcase how the MetaData linked list coalesces adjacent free blocks, which can be seen visually by calling
- * the printMetaData() function. Also, it will try to allocate more memory than available, which shows how malloc() handles being requested more memory than available.
- * Calculates runtime using gettimeofday from sys/time.h library.
- * @param[out] runtime for workloadE
+ * the printMetaData() function. Also, it will allocate more memory than myblock has left, which shows how malloc() grows the heap with a newly mapped chunk.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
+ * @param[in] number of times workloadE should repeat the pattern
+ * @param[out] runtime for workloadE in nanoseconds
  */ 
-long workloadE () {
-    struct timeval start;
-    struct timeval end;
+long long workloadE (int numEIterations) {
+    long long start = 0; // monotonic clock reading when the workload starts
     char *ptr1;
     char *ptr2;
     char *ptr3;
     char *ptr4;
 
-    gettimeofday(&start, NULL); // getting current time of day
+    start = nowNanoseconds(); // reading the monotonic clock
+    for (int i = 0; i < numEIterations; i++) {
+        ptr1 = (char*) malloc(200);
+        ptr2 = (char*) malloc(200);
+        ptr3 = (char*) malloc(200);
 
-    ptr1 = (char*) malloc(200);
-    ptr2 = (char*) malloc(200);
-    ptr3 = (char*) malloc(200);
+        /* if calling printMetaData(), run only this workload (memgrind -w E) for a cleaner look to output screen */
 
-    /* if calling printMetaData(), refer to main function and uncomment workloadE section code for a cleaner look to output screen */
+        /* call (uncomment) printMetaData here if a visual prior to coalescing would like to be seen */
+        // printMetaData();
+        free(ptr1);
+        free(ptr2); // myfree() coalesces ptr2 with the already free ptr1 right away
+        ptr4 = (char*) malloc(300); // these 300 bytes fit in the combined userdata from ptr1 and ptr2
+        /* call (uncomment) printMetaData here if a visual after coalescing and mallocing 300 bytes would like to be seen */
+        // printMetaData();
 
-    /* call (uncomment) printMetaData here if a visual prior to coalescing would like to be seen */
-    // printMetaData();
-    free(ptr1);
-    free(ptr2);
-    ptr4 = (char*) malloc(300); // when mallocing these 300 bytes, coalesce() will be called, where in the userdata from ptr1 and ptr2 will be combined
-    /* call (uncomment) printMetaData here if a visual after coalescing and mallocing 300 bytes would like to be seen */
-    // printMetaData();
+        /* more than myblock has left, so malloc() maps another heap chunk to serve it */
+        ptr1 = (char*) malloc(4080);
+
+        /* freeing these pointers to clean up the heap for next workload call */
+        free(ptr1);
+        free(ptr3);
+        free(ptr4);
+    }
+
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
 
-    /* malloc() feature that prints an error when more than available memory is requested */
-    ptr1 = (char*) malloc(4080);
+/**
+ * Body of a single workloadF thread: repeatedly malloc() a few small blocks, touch them and free() them again.
+ * @param[in] pointer to the number of rounds this thread should run
+ * @param[out] NULL
+ */
+void* workloadFThread (void *arg) {
+    int numRounds = *(int*) arg;
+    char *pointers[WORKLOADF_LIVE_BLOCKS];
 
-    /* freeing these two pointers to clean up myblock for next workload call */
-    free(ptr3);
-    free(ptr4);
+    for (int i = 0; i < numRounds; i++) {
+        for (int j = 0; j < WORKLOADF_LIVE_BLOCKS; j++) {
+            pointers[j] = malloc(16);
+            pointers[j][0] = (char) j;
+        }
+        for (int j = 0; j < WORKLOADF_LIVE_BLOCKS; j++) {
+            free(pointers[j]);
+        }
+    }
 
-    gettimeofday(&end, NULL); // store end time after running workload
-    return (end.tv_usec - start.tv_usec); // returning end time - start time in microseconds
+    __atomic_fetch_add(&finishedThreadOps, threadOps, __ATOMIC_RELAXED); // hand this thread's count to the harness
+    return NULL;
 }
 
 /**
- * Helper function used to calculate the mean time for each workload A, B, C, D, E.
- * @param[in] array of workload times for each respective workload
- * @param[in] number of iterations each workload is run
- * @param[out] mean time for respective workload
- */ 
-long calculateMeanTime (long *workloadTimes, int numWorkloadIterations) {
-    long sum = 0;
+ * Memgrind workload function that runs the same small malloc()/free() loop on several threads at once to show
+ * how throughput scales with cores. Each thread mostly hits its own cache, so the threads should rarely contend.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
+ * The number of threads is taken from workloadFThreads.
+ * @param[in] number of rounds each thread should run (each round is WORKLOADF_LIVE_BLOCKS mallocs and frees)
+ * @param[out] runtime for workloadF in nanoseconds
+ */
+long long workloadF (int numFIterations) {
+    int numThreads = workloadFThreads;
+    long long start = 0; // monotonic clock reading when the workload starts
+    pthread_t threads[MAX_WORKLOADF_THREADS];
+
+    if (numThreads < 1 || numThreads > MAX_WORKLOADF_THREADS) {
+        return 0;
+    }
+
+    start = nowNanoseconds(); // reading the monotonic clock
+    for (int i = 0; i < numThreads; i++) {
+        pthread_create(&threads[i], NULL, workloadFThread, &numFIterations);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
+
+/**
+ * Memgrind workload function that grows a few vectors side by side with realloc(), the way a dynamic array
+ * appends elements, then frees them. Vectors that sit next to free space grow in place; the others have to be
+ * copied. Counts how many of the realloc() calls kept the same pointer.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
+ * In-place calls are added to workloadGInPlace.
+ * @param[in] number of realloc() calls workloadG should make
+ * @param[out] runtime for workloadG in nanoseconds
+ */
+long long workloadG (int numGIterations) {
+    long long start = 0; // monotonic clock reading when the workload starts
+    char *vectors[WORKLOADG_VECTORS] = { NULL }; // vectors being grown
+    size_t lengths[WORKLOADG_VECTORS] = { 0 }; // current length of each vector
+    char *grown = NULL; // vector returned by realloc()
+    int v = 0; // vector grown in the current iteration
+
+    start = nowNanoseconds(); // reading the monotonic clock
+    for (int i = 0; i < numGIterations; i++) {
+        // mostly keep growing the same vector, but switch every now and then so they interleave
+        if (rand() % 4 == 0) {
+            v = rand() % WORKLOADG_VECTORS;
+        }
+
+        grown = (char*) realloc(vectors[v], lengths[v] + WORKLOADG_STEP);
+        if (grown == NULL) {
+            break;
+        }
+        if (grown == vectors[v]) {
+            workloadGInPlace++;
+        }
+        grown[lengths[v]] = (char) i; // append an element
+        vectors[v] = grown;
+        lengths[v] += WORKLOADG_STEP;
+    }
+
+    for (int i = 0; i < WORKLOADG_VECTORS; i++) {
+        free(vectors[i]);
+    }
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
+
+/**
+ * Size of the given object of a request in workloadH and workloadI: a mix of small nodes, strings and a few
+ * larger buffers, the same for every request so both workloads allocate exactly the same objects.
+ * @param[in] index of the object within the request
+ * @param[out] size in bytes
+ */
+size_t requestObjectSize (int object) {
+    static const size_t sizes[] = { 24, 16, 48, 32, 120, 8, 64, 200, 40, 16, 512, 96 };
+
+    return sizes[object % (int) (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+/**
+ * Memgrind workload function that models a server handling requests: each request malloc()s REQUEST_OBJECTS
+ * objects of mixed sizes, touches them, and frees every one of them when it is done. workloadI handles the same
+ * requests with an arena to compare against.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
+ * @param[in] number of requests workloadH should handle
+ * @param[out] runtime for workloadH in nanoseconds
+ */
+long long workloadH (int numHRequests) {
+    long long start = 0; // monotonic clock reading when the workload starts
+    char *objects[REQUEST_OBJECTS]; // objects of the request being handled
+
+    start = nowNanoseconds(); // reading the monotonic clock
+    for (int i = 0; i < numHRequests; i++) {
+        for (int j = 0; j < REQUEST_OBJECTS; j++) {
+            objects[j] = malloc(requestObjectSize(j));
+            objects[j][0] = (char) j;
+        }
+        for (int j = 0; j < REQUEST_OBJECTS; j++) {
+            free(objects[j]);
+        }
+    }
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
+
+/**
+ * Memgrind workload function that handles the same requests as workloadH, but takes each request's objects from
+ * an arena with arena_alloc() and gives them all back with a single arena_reset() when the request is done.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
+ * @param[in] number of requests workloadI should handle
+ * @param[out] runtime for workloadI in nanoseconds
+ */
+long long workloadI (int numIRequests) {
+    long long start = 0; // monotonic clock reading when the workload starts
+    Arena *arena = NULL; // where every request's objects come from
+    char *object = NULL;
+
+    start = nowNanoseconds(); // reading the monotonic clock
+    arena = arena_create();
+    if (arena == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < numIRequests; i++) {
+        for (int j = 0; j < REQUEST_OBJECTS; j++) {
+            object = arena_alloc(arena, requestObjectSize(j));
+            object[0] = (char) j;
+        }
+        arena_reset(arena);
+    }
+    arena_destroy(arena);
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
+
+/**
+ * Memgrind workload function that does what workloadB does with one malloc_batch() call for all the 1 byte
+ * blocks and one free_batch() call to free them again, to compare against allocating them one by one.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
+ * @param[in] number of blocks workloadJ should allocate
+ * @param[out] runtime for workloadJ in nanoseconds
+ */
+long long workloadJ (int numJBlocks) {
+    long long start = 0; // monotonic clock reading when the workload starts
+    void* pointers[numJBlocks > 0 ? numJBlocks : 1]; // array storing pointers to individual bytes
+
+    if (numJBlocks <= 0) {
+        return 0;
+    }
+
+    start = nowNanoseconds(); // reading the monotonic clock
+    if (malloc_batch(1, numJBlocks, pointers)) {
+        free_batch(pointers, numJBlocks);
+    }
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
+
+/**
+ * Memgrind workload function that fragments the heap on purpose: it malloc()s WORKLOADK_LIVE_BLOCKS blocks of
+ * random sizes between 72 bytes and 2KiB, then over and over frees a random one and malloc()s another random size
+ * in its place. The sizes come from a fixed seed, so every run, and every placement policy, sees the same requests.
+ * At the end the largest free heap block tells how large a request the heap could still serve without growing,
+ * and is stored in workloadKLargestFree along with the fragmentation.
+ * Calculates runtime using the monotonic clock, see nowNanoseconds().
+ * @param[in] number of blocks workloadK replaces
+ * @param[out] runtime for workloadK in nanoseconds
+ */
+long long workloadK (int numKSteps) {
+    long long start = 0; // monotonic clock reading when the workload starts
+    long long runtime = 0;
+    char *pointers[WORKLOADK_LIVE_BLOCKS];
+    unsigned int seed = 1; // same sizes every run
+    int victim = 0;
+    MallocStats stats;
+
+    start = nowNanoseconds(); // reading the monotonic clock
+    for (int i = 0; i < WORKLOADK_LIVE_BLOCKS; i++) {
+        pointers[i] = malloc(72 + rand_r(&seed) % 1977);
+    }
+    for (int i = 0; i < numKSteps; i++) {
+        victim = rand_r(&seed) % WORKLOADK_LIVE_BLOCKS;
+        free(pointers[victim]);
+        pointers[victim] = malloc(72 + rand_r(&seed) % 1977);
+    }
+    runtime = nowNanoseconds() - start;
+
+    stats = mymalloc_stats(); // not timed, it looks through a bin
+    workloadKLargestFree = stats.largestfree;
+    workloadKFragmentation = stats.fragmentation;
+
+    start = nowNanoseconds();
+    for (int i = 0; i < WORKLOADK_LIVE_BLOCKS; i++) {
+        free(pointers[i]);
+    }
+    return runtime + (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
+
+/**
+ * PointerMap is an open addressing hash table from the pointers recorded in a trace to the replay slot
+ * holding that block, used while a trace is loaded. Removed entries are left as tombstones.
+ */
+#define POINTERMAP_EMPTY 0
+#define POINTERMAP_TOMBSTONE 1 // never a user data block address
+
+typedef struct PointerMap {
+    uint64_t *keys;
+    unsigned int *slots;
+    size_t capacity; // a power of two
+    size_t used; // entries including tombstones
+} PointerMap;
+
+/**
+ * Helper function used to find where a recorded pointer is, or would go, in a PointerMap.
+ * @param[in] map
+ * @param[in] recorded pointer
+ * @param[out] index of the pointer's entry, or of the empty entry ending its probe sequence
+ */
+size_t pointerMapProbe (PointerMap *map, uint64_t key) {
+    size_t index = (size_t) ((key >> 4) * 0x9E3779B97F4A7C15ULL) & (map->capacity - 1);
+
+    while (map->keys[index] != POINTERMAP_EMPTY && map->keys[index] != key) {
+        index = (index + 1) & (map->capacity - 1);
+    }
+
+    return index;
+}
+
+/**
+ * Helper function used to map a recorded pointer to a slot, growing the map when it gets half full.
+ * @param[in] map
+ * @param[in] recorded pointer
+ * @param[in] slot
+ * @param[out] 1 on success, 0 if out of memory
+ */
+int pointerMapInsert (PointerMap *map, uint64_t key, unsigned int slot) {
+    PointerMap grown;
+    size_t index = 0;
+
+    if ((map->used + 1) * 2 > map->capacity) {
+        grown.capacity = (map->capacity == 0) ? 1024 : map->capacity * 2;
+        grown.used = 0;
+        grown.keys = (uint64_t*) (calloc)(grown.capacity, sizeof(uint64_t));
+        grown.slots = (unsigned int*) (calloc)(grown.capacity, sizeof(unsigned int));
+        if (grown.keys == NULL || grown.slots == NULL) {
+            (free)(grown.keys);
+            (free)(grown.slots);
+            return 0;
+        }
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i] != POINTERMAP_EMPTY && map->keys[i] != POINTERMAP_TOMBSTONE) {
+                index = pointerMapProbe(&grown, map->keys[i]);
+                grown.keys[index] = map->keys[i];
+                grown.slots[index] = map->slots[i];
+                grown.used++;
+            }
+        }
+        (free)(map->keys);
+        (free)(map->slots);
+        *map = grown;
+    }
+
+    index = pointerMapProbe(map, key);
+    if (map->keys[index] == POINTERMAP_EMPTY) {
+        map->used++;
+    }
+    map->keys[index] = key;
+    map->slots[index] = slot;
+    return 1;
+}
+
+/**
+ * Helper function used to take a recorded pointer out of a PointerMap.
+ * @param[in] map
+ * @param[in] recorded pointer
+ * @param[out] slot the pointer was mapped to, or -1 if it is not in the map
+ */
+long pointerMapRemove (PointerMap *map, uint64_t key) {
+    size_t index = 0;
+
+    if (map->capacity == 0) {
+        return -1;
+    }
+
+    index = pointerMapProbe(map, key);
+    if (map->keys[index] != key) {
+        return -1;
+    }
+
+    map->keys[index] = POINTERMAP_TOMBSTONE;
+    return map->slots[index];
+}
+
+/**
+ * Loads a trace recorded with mymalloc_trace_start() (or the MYMALLOC_TRACE environment variable) and turns it
+ * into replay operations. Slots are reused as soon as their block is freed, so the replay holds no more blocks
+ * than the traced program did. The trace's own memory comes from the system allocator, so it does not disturb
+ * the heap being measured.
+ * @param[in] path of the trace file
+ * @param[in] replay to fill in
+ * @param[out] 1 on success, 0 if the file is missing, not a trace, or too large for memory
+ */
+int loadTrace (const char *path, Replay *loaded) {
+    FILE *in = fopen(path, "rb");
+    TraceHeader header;
+    TraceRecord record;
+    PointerMap map;
+    unsigned int *freeSlots = NULL; // slots whose block has been freed, reused first
+    unsigned int numFreeSlots = 0;
+    long capacity = 0;
+    long slot = 0;
+    ReplayOp *op = NULL;
+    void *grown = NULL;
+    int ok = 1;
+
+    memset(loaded, 0, sizeof(*loaded));
+    memset(&map, 0, sizeof(map));
+    if (in == NULL) {
+        printf("Could not open trace %s\n", path);
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.recordsize != sizeof(TraceRecord)) {
+        printf("%s is not a trace this version of memgrind can replay\n", path);
+        fclose(in);
+        return 0;
+    }
+
+    while (ok && fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.op == TRACE_FILE) { // only needed to tell where calls came from, which replay does not use
+            fseek(in, (long) record.size, SEEK_CUR);
+            continue;
+        }
+
+        if (loaded->numOps == capacity) {
+            capacity = (capacity == 0) ? 4096 : capacity * 2;
+            grown = (realloc)(loaded->ops, capacity * sizeof(ReplayOp));
+            ok = (grown != NULL);
+            if (!ok) {
+                break;
+            }
+            loaded->ops = (ReplayOp*) grown;
+        }
+        op = &loaded->ops[loaded->numOps];
+        op->op = (char) record.op;
+        op->size = record.size;
+        op->alignment = (record.op == TRACE_ALIGNED_ALLOC) ? record.extra : 0;
 
-    for (int i = 0; i < numWorkloadIterations; i++) {
-        sum += workloadTimes[i];
+        slot = -1;
+        if (record.op == TRACE_FREE) {
+            slot = pointerMapRemove(&map, record.ptr);
+            if (slot < 0) {
+                loaded->numSkipped++;
+                continue;
+            }
+            freeSlots[numFreeSlots++] = (unsigned int) slot;
+        } else if (record.op == TRACE_REALLOC) {
+            slot = pointerMapRemove(&map, record.extra);
+            if (slot < 0) { // resizing a block from before the trace started is replayed as handing out a new one
+                op->op = TRACE_MALLOC;
+            }
+        } else if (record.op != TRACE_MALLOC && record.op != TRACE_ALIGNED_ALLOC) {
+            printf("%s is corrupted: unknown record\n", path);
+            ok = 0;
+            break;
+        }
+
+        if (record.op != TRACE_FREE) {
+            if (slot < 0 && numFreeSlots > 0) {
+                slot = freeSlots[--numFreeSlots];
+            } else if (slot < 0) {
+                slot = loaded->numSlots++;
+                grown = (realloc)(freeSlots, loaded->numSlots * sizeof(unsigned int));
+                ok = (grown != NULL);
+                freeSlots = (unsigned int*) grown;
+            }
+            ok = ok && pointerMapInsert(&map, record.ptr, (unsigned int) slot);
+        }
+        op->slot = (unsigned int) slot;
+        loaded->numOps++;
     }
+    fclose(in);
+    (free)(freeSlots);
+    (free)(map.keys);
+    (free)(map.slots);
 
-    return (sum / numWorkloadIterations);
+    if (ok) {
+        loaded->blocks = (void**) (calloc)(loaded->numSlots + 1, sizeof(void*));
+        loaded->sizes = (size_t*) (calloc)(loaded->numSlots + 1, sizeof(size_t));
+        ok = (loaded->blocks != NULL && loaded->sizes != NULL);
+    }
+    if (!ok) {
+        printf("Not enough memory to load trace %s\n", path);
+    }
+    return ok;
+}
+
+/**
+ * Updates the live bytes of the replay and the peak footprint stored in footprintResult after one replayed call.
+ * @param[in] slot the call worked on
+ * @param[in] requested size of the block now in that slot, 0 if it was freed
+ */
+void trackFootprint (unsigned int slot, size_t size) {
+    size_t footprint = mymalloc_footprint();
+
+    replay.liveBytes = replay.liveBytes - replay.sizes[slot] + size;
+    replay.sizes[slot] = size;
+    if (replay.liveBytes > footprintResult->peakLive) {
+        footprintResult->peakLive = replay.liveBytes;
+    }
+    if (footprint > footprintResult->peakFootprint) {
+        footprintResult->peakFootprint = footprint;
+    }
+}
+
+/**
+ * Memgrind workload function that replays a loaded trace call by call, then frees whatever the trace left
+ * allocated so the next run starts from the same heap.
+ * @param[in] number of times to replay the trace
+ * @param[out] runtime for the replay in nanoseconds
+ */
+long long workloadR (int numRIterations) {
+    long long start = 0; // monotonic clock reading when the workload starts
+    ReplayOp *op = NULL;
+    void *resized = NULL;
+
+    start = nowNanoseconds(); // reading the monotonic clock
+    for (int i = 0; i < numRIterations; i++) {
+        for (long j = 0; j < replay.numOps; j++) {
+            op = &replay.ops[j];
+            switch (op->op) {
+                case TRACE_MALLOC:
+                    replay.blocks[op->slot] = malloc(op->size);
+                    break;
+                case TRACE_ALIGNED_ALLOC:
+                    replay.blocks[op->slot] = aligned_alloc(op->alignment, op->size);
+                    break;
+                case TRACE_FREE:
+                    if (replay.blocks[op->slot] != NULL) { // the allocation may have failed under this allocator
+                        free(replay.blocks[op->slot]);
+                        replay.blocks[op->slot] = NULL;
+                    }
+                    break;
+                case TRACE_REALLOC:
+                    resized = realloc(replay.blocks[op->slot], op->size);
+                    if (resized != NULL) {
+                        replay.blocks[op->slot] = resized;
+                    }
+                    break;
+            }
+            if (measureFootprint) {
+                trackFootprint(op->slot, (replay.blocks[op->slot] != NULL) ? op->size : 0);
+            }
+        }
+
+        for (unsigned int j = 0; j < replay.numSlots; j++) {
+            if (replay.blocks[j] != NULL) {
+                free(replay.blocks[j]);
+                replay.blocks[j] = NULL;
+                if (measureFootprint) {
+                    trackFootprint(j, 0);
+                }
+            }
+        }
+    }
+    return (nowNanoseconds() - start); // returning end time - start time in nanoseconds
+}
+
+/**
+ * Helper function used to compare latency samples for qsort().
+ */
+int compareSamples (const void *a, const void *b) {
+    unsigned int x = *(const unsigned int*) a;
+    unsigned int y = *(const unsigned int*) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Helper function used to read a percentile out of sorted latency samples.
+ * @param[in] sorted samples
+ * @param[in] number of samples
+ * @param[in] percentile as a fraction, e.g. 0.99
+ * @param[out] smallest sample that at least that fraction of the samples does not exceed
+ */
+long long percentile (unsigned int *samples, long numSamples, double fraction) {
+    long index = (long) (fraction * numSamples + 0.999999) - 1;
+
+    if (numSamples == 0) {
+        return 0;
+    }
+
+    return samples[(index < 0) ? 0 : index];
+}
+
+/**
+ * Runs one workload the way the harness measures every workload: untimed warmup runs first, then timed
+ * runs for runtime and throughput, then the same number of runs with every operation timed for the latency
+ * percentiles. Timing each operation slows it down, so the two are kept apart.
+ * @param[in] workload to run
+ * @param[in] number of warmup runs
+ * @param[in] number of measured runs
+ * @param[out] measurements
+ */
+Result runWorkload (Workload *workload, int numWarmups, int numRuns) {
+    Result result;
+    long long totalNanoseconds = 0;
+    long numOps = 0;
+
+    memset(&result, 0, sizeof(result));
+    result.name = workload->name;
+    result.policy = mymalloc_policy();
+    result.threads = (workload->name == 'F') ? workloadFThreads : 1;
+    result.param = workload->param;
+    result.runs = numRuns;
+
+    for (int i = 0; i < numWarmups; i++) {
+        workload->run(workload->param);
+    }
+
+    workloadGInPlace = 0;
+    threadOps = 0;
+    finishedThreadOps = 0;
+    for (int i = 0; i < numRuns; i++) {
+        totalNanoseconds += workload->run(workload->param);
+    }
+    numOps = threadOps + finishedThreadOps;
+    result.inPlace = workloadGInPlace;
+    if (workload->name == 'K') {
+        result.largestFree = workloadKLargestFree;
+        result.fragmentation = workloadKFragmentation;
+    }
+
+    numLatencySamples = 0;
+    recordLatency = 1;
+    for (int i = 0; i < numRuns; i++) {
+        workload->run(workload->param);
+    }
+    recordLatency = 0;
+    if (numLatencySamples > MAX_LATENCY_SAMPLES) {
+        numLatencySamples = MAX_LATENCY_SAMPLES;
+    }
+    qsort(latencySamples, numLatencySamples, sizeof(unsigned int), compareSamples);
+
+    result.opsPerRun = (numRuns > 0) ? numOps / numRuns : 0;
+    result.meanMicroseconds = (numRuns > 0) ? totalNanoseconds / 1000.0 / numRuns : 0;
+    result.opsPerSecond = (totalNanoseconds > 0) ? numOps / (totalNanoseconds / 1e9) : 0;
+    result.p50 = percentile(latencySamples, numLatencySamples, 0.50);
+    result.p99 = percentile(latencySamples, numLatencySamples, 0.99);
+    result.p999 = percentile(latencySamples, numLatencySamples, 0.999);
+
+    /* one more untimed run of a trace replay tracks how much memory the allocator needed for it */
+    if (workload->name == 'R') {
+        footprintResult = &result;
+        measureFootprint = 1;
+        workload->run(workload->param);
+        measureFootprint = 0;
+        if (result.peakFootprint > 0) {
+            result.fragmentation = 1.0 - (double) result.peakLive / result.peakFootprint;
+        }
+    }
+    return result;
+}
+
+/**
+ * Writes all results in the requested format: a human readable summary, CSV with a header row, or a JSON array.
+ * @param[in] stream to write to
+ * @param[in] "text", "csv" or "json"
+ * @param[in] results
+ * @param[in] number of results
+ */
+void printResults (FILE *out, const char *format, Result *results, int numResults) {
+    Result *r = NULL;
+
+    if (strcmp(format, "csv") == 0) {
+        fprintf(out, "workload,policy,threads,param,runs,ops_per_run,mean_us,ops_per_sec,p50_ns,p99_ns,p999_ns,in_place,peak_footprint,peak_live,fragmentation,largest_free\n");
+        for (int i = 0; i < numResults; i++) {
+            r = &results[i];
+            fprintf(out, "%c,%s,%d,%d,%d,%ld,%.3f,%.0f,%lld,%lld,%lld,%ld,%zu,%zu,%.4f,%zu\n", r->name, policyNames[r->policy], r->threads, r->param, r->runs, r->opsPerRun,
+                    r->meanMicroseconds, r->opsPerSecond, r->p50, r->p99, r->p999, r->inPlace, r->peakFootprint, r->peakLive, r->fragmentation, r->largestFree);
+        }
+    } else if (strcmp(format, "json") == 0) {
+        fprintf(out, "[\n");
+        for (int i = 0; i < numResults; i++) {
+            r = &results[i];
+            fprintf(out, "  {\"workload\": \"%c\", \"policy\": \"%s\", \"threads\": %d, \"param\": %d, \"runs\": %d, \"ops_per_run\": %ld, \"mean_us\": %.3f, "
+                    "\"ops_per_sec\": %.0f, \"p50_ns\": %lld, \"p99_ns\": %lld, \"p999_ns\": %lld, \"in_place\": %ld, "
+                    "\"peak_footprint\": %zu, \"peak_live\": %zu, \"fragmentation\": %.4f, \"largest_free\": %zu}%s\n",
+                    r->name, policyNames[r->policy], r->threads, r->param, r->runs, r->opsPerRun, r->meanMicroseconds, r->opsPerSecond,
+                    r->p50, r->p99, r->p999, r->inPlace, r->peakFootprint, r->peakLive, r->fragmentation, r->largestFree, (i + 1 < numResults) ? "," : "");
+        }
+        fprintf(out, "]\n");
+    } else {
+        fprintf(out, "----------------------------------------------------\n");
+        for (int i = 0; i < numResults; i++) {
+            r = &results[i];
+            fprintf(out, "Workload %c", r->name);
+            if (r->name == 'F') {
+                fprintf(out, " with %d thread(s)", r->threads);
+            }
+            if (comparingPolicies) {
+                fprintf(out, " (%s)", policyNames[r->policy]);
+            }
+            fprintf(out, ": mean %.1f microseconds per run, %ld operations per run, %.0f operations/second\n", r->meanMicroseconds, r->opsPerRun, r->opsPerSecond);
+            fprintf(out, "    latency per operation: p50 %lld ns, p99 %lld ns, p99.9 %lld ns\n", r->p50, r->p99, r->p999);
+            if (r->name == 'G') {
+                fprintf(out, "    %ld of %ld reallocs completed in place\n", r->inPlace, (long) r->param * r->runs);
+            }
+            if (r->name == 'R') {
+                fprintf(out, "    peak footprint %zu bytes for at most %zu live bytes, %.1f%% fragmentation\n", r->peakFootprint, r->peakLive, 100.0 * r->fragmentation);
+            }
+            if (r->name == 'K') {
+                fprintf(out, "    largest request served without growing the heap: %zu bytes, %.1f%% fragmentation\n", r->largestFree, 100.0 * r->fragmentation);
+            }
+        }
+        fprintf(out, "----------------------------------------------------\n");
+    }
+}
+
+/**
+ * The stress test (-S) runs a long random mix of malloc(), aligned_alloc(), realloc(), free() and batch calls
+ * of sizes from 1 byte up to large mappings, some blocks freed again right away and some kept for long. Every
+ * block is filled with its own byte, which is checked before it is freed or resized and periodically for all
+ * of them, and every new block is checked against all live ones for overlap. After every step mymalloc_check()
+ * walks the whole heap. At the end a few threads free a block from a thread-specific data destructor while they
+ * exit. The first problem found stops the test.
+ */
+#define STRESS_SLOTS 1024 // most blocks the stress test holds at once
+#define STRESS_SHORT_SLOTS 64 // slots reused most of the time, holding the short lived blocks
+#define STRESS_SAMPLES 20 // fragmentation samples taken over the test
+#define STRESS_MAX_BATCH 16 // most blocks one batch call hands out
+#define STRESS_EXITING_THREADS 4 // threads started at the end, each freeing a block while it exits
+
+typedef struct StressBlock {
+    unsigned char *ptr;
+    size_t size; // requested size
+    unsigned char fill; // byte the whole block holds
+} StressBlock;
+
+static StressBlock stressBlocks[STRESS_SLOTS];
+static pthread_key_t stressKey; // holds the block an exiting stress test thread frees from its destructor
+
+/**
+ * Picks the size of the next stress test block: mostly small, some medium sized, a few close to and beyond
+ * the size served by dedicated mappings.
+ * @param[out] size in bytes
+ */
+size_t stressSize () {
+    int kind = rand() % 100;
+
+    if (kind < 50) {
+        return 1 + rand() % 64;
+    } else if (kind < 80) {
+        return 65 + rand() % 960;
+    } else if (kind < 95) {
+        return 1025 + rand() % 15360;
+    } else if (kind < 99) {
+        return 16385 + rand() % 16384;
+    }
+    return 32769 + rand() % 100000;
+}
+
+/**
+ * Helper function used to report a problem the stress test found.
+ * @param[in] step it was found at
+ * @param[in] what is wrong
+ * @param[out] 0, for the caller to return
+ */
+int stressFailed (long step, const char *problem) {
+    printf("Stress Error: %s at step %ld\n", problem, step);
+    return 0;
+}
+
+/**
+ * Checks that a block still holds the byte it was filled with.
+ * @param[in] block
+ * @param[in] number of bytes from its start to check
+ * @param[out] 1 if they are intact, 0 if any byte changed
+ */
+int stressIntact (StressBlock *block, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (block->ptr[i] != block->fill) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 /**
- * Main function is the entry point into the program. The user is able to grind the preset workloads to see the
- * mean run time of each. They are also able to create their own workloads, and test the malloc() and free() functions.
- * Lastly, they are able to print out the simulated memory, as well as the MetaData linked list using functions
- * printMemory() and printMetaData() to see how the memory is being handled after each call to malloc() and free() functions.
+ * Checks a block the allocator just handed out, then fills it.
+ * @param[in] block, with ptr and size set
+ * @param[in] alignment it was asked for
+ * @param[in] step number, which with the slot picks the fill byte
+ * @param[out] 1 if the block is usable, 0 if it is NULL, misaligned, too small or overlaps a live block
+ */
+int stressAccept (StressBlock *block, size_t alignment, long step) {
+    if (block->ptr == NULL || (uintptr_t) block->ptr % alignment != 0 || mymalloc_usable_size(block->ptr) < block->size) {
+        return 0;
+    }
+    for (int i = 0; i < STRESS_SLOTS; i++) {
+        if (&stressBlocks[i] != block && stressBlocks[i].ptr != NULL &&
+            block->ptr < stressBlocks[i].ptr + stressBlocks[i].size && stressBlocks[i].ptr < block->ptr + block->size) {
+            return 0;
+        }
+    }
+
+    block->fill = (unsigned char) (step * 31 + (block - stressBlocks));
+    memset(block->ptr, block->fill, block->size);
+    return 1;
+}
+
+/**
+ * Stress test step handing out and giving back a batch of blocks of one size, all checked in between. Now and
+ * then some of the pointers are given to free_batch() twice, which it has to report and skip without touching
+ * any other block.
+ * @param[in] step number
+ * @param[out] 1 if the batch was correct, 0 otherwise
+ */
+int stressBatch (long step) {
+    void *pointers[2 * STRESS_MAX_BATCH];
+    size_t size = 1 + rand() % 256;
+    int count = 1 + rand() % STRESS_MAX_BATCH;
+    int repeats = (rand() % 8 == 0) ? 1 + rand() % 2 : 0; // pointers given again, each reported as a double free
+
+    if (!malloc_batch(size, count, pointers)) {
+        return stressFailed(step, "malloc_batch() failed");
+    }
+    for (int i = 0; i < count; i++) {
+        memset(pointers[i], i, size);
+    }
+    for (int i = 0; i < count; i++) {
+        for (size_t j = 0; j < size; j++) {
+            if (((unsigned char*) pointers[i])[j] != (unsigned char) i) {
+                return stressFailed(step, "Blocks handed out by malloc_batch() overlap");
+            }
+        }
+    }
+    for (int i = 0; i < repeats; i++) {
+        pointers[count + i] = pointers[rand() % count];
+    }
+    free_batch(pointers, count + repeats);
+    return 1;
+}
+
+/**
+ * Destructor of stressKey. The key is created after the allocator's own, so this runs once the allocator has
+ * already cleaned up after the exiting thread, the way destructors in a program using libmymalloc.so can.
+ * @param[in] block the thread left behind
+ */
+void stressExitFree (void *ptr) {
+    free(ptr);
+}
+
+/**
+ * Body of a stress test thread that allocates a block and leaves it to stressExitFree().
+ * @param[in] unused
+ * @param[out] NULL
+ */
+void* stressExitingThread (void *arg) {
+    (void) arg;
+    pthread_setspecific(stressKey, malloc(100));
+    return NULL;
+}
+
+/**
+ * Runs the stress test and writes a fragmentation sample STRESS_SAMPLES times along the way: the blocks and
+ * bytes the test holds, the allocator's footprint, its free bytes, largest free block and fragmentation as
+ * reported by mymalloc_stats().
+ * @param[in] stream to write the samples to
+ * @param[in] "text", "csv" or "json"
+ * @param[in] number of steps
+ * @param[in] seed for rand(), so a failing run can be repeated
+ * @param[out] 1 if no problem was found, 0 otherwise
+ */
+int runStress (FILE *out, const char *format, long numSteps, unsigned int seed) {
+    StressBlock *block = NULL;
+    MallocStats stats;
+    size_t startInUse = mymalloc_stats().inuse; // bytes handed out before the test, there again at its end
+    size_t liveBytes = 0;
+    int liveBlocks = 0;
+    long interval = (numSteps / STRESS_SAMPLES > 0) ? numSteps / STRESS_SAMPLES : 1;
+    size_t alignment = 0;
+    size_t oldSize = 0;
+    unsigned char *resized = NULL;
+    pthread_t exitingThreads[STRESS_EXITING_THREADS];
+
+    srand(seed);
+    if (strcmp(format, "csv") == 0) {
+        fprintf(out, "step,live_blocks,live_bytes,footprint,free_bytes,largest_free,fragmentation\n");
+    } else if (strcmp(format, "json") == 0) {
+        fprintf(out, "[\n");
+    } else {
+        fprintf(out, "Stress test: %ld steps, seed %u\n", numSteps, seed);
+        fprintf(out, "%10s %12s %12s %12s %12s %12s %14s\n", "step", "live blocks", "live bytes", "footprint", "free bytes", "largest free", "fragmentation");
+    }
+
+    for (long step = 1; step <= numSteps; step++) {
+        // most steps churn a few short lived blocks, the rest come and go among all of them
+        block = &stressBlocks[(rand() % 4 != 0) ? rand() % STRESS_SHORT_SLOTS : rand() % STRESS_SLOTS];
+
+        if (rand() % 32 == 0) {
+            if (!stressBatch(step)) {
+                return 0;
+            }
+        } else if (block->ptr == NULL) {
+            block->size = stressSize();
+            alignment = 16;
+            if (rand() % 16 == 0) {
+                alignment = (size_t) 32 << (rand() % 8);
+                block->ptr = aligned_alloc(alignment, block->size);
+            } else {
+                block->ptr = malloc(block->size);
+            }
+            if (!stressAccept(block, alignment, step)) {
+                return stressFailed(step, "Block handed out that is NULL, misaligned, too small or overlapping a live block");
+            }
+            liveBytes += block->size;
+            liveBlocks++;
+        } else if (!stressIntact(block, block->size)) {
+            return stressFailed(step, "Live block overwritten");
+        } else if (rand() % 8 == 0) {
+            oldSize = block->size;
+            block->size = stressSize();
+            resized = realloc(block->ptr, block->size);
+            if (resized == NULL) {
+                return stressFailed(step, "realloc() failed");
+            }
+            block->ptr = resized;
+            if (!stressIntact(block, (oldSize < block->size) ? oldSize : block->size)) {
+                return stressFailed(step, "realloc() lost the contents of a block");
+            }
+            if (!stressAccept(block, 16, step)) {
+                return stressFailed(step, "Block handed out by realloc() that is misaligned, too small or overlapping a live block");
+            }
+            liveBytes = liveBytes - oldSize + block->size;
+        } else {
+            free(block->ptr);
+            block->ptr = NULL;
+            liveBytes -= block->size;
+            liveBlocks--;
+        }
+
+        if (mymalloc_check() != 0) {
+            return stressFailed(step, "Inconsistent heap");
+        }
+
+        if (step % interval == 0 || step == numSteps) {
+            for (int i = 0; i < STRESS_SLOTS; i++) {
+                if (stressBlocks[i].ptr != NULL && !stressIntact(&stressBlocks[i], stressBlocks[i].size)) {
+                    return stressFailed(step, "Live block overwritten");
+                }
+            }
+            stats = mymalloc_stats();
+            if (strcmp(format, "csv") == 0) {
+                fprintf(out, "%ld,%d,%zu,%zu,%zu,%zu,%.4f\n", step, liveBlocks, liveBytes, stats.footprint, stats.freebytes, stats.largestfree, stats.fragmentation);
+            } else if (strcmp(format, "json") == 0) {
+                fprintf(out, "  {\"step\": %ld, \"live_blocks\": %d, \"live_bytes\": %zu, \"footprint\": %zu, \"free_bytes\": %zu, \"largest_free\": %zu, \"fragmentation\": %.4f}%s\n",
+                        step, liveBlocks, liveBytes, stats.footprint, stats.freebytes, stats.largestfree, stats.fragmentation, (step == numSteps) ? "" : ",");
+            } else {
+                fprintf(out, "%10ld %12d %12zu %12zu %12zu %12zu %13.1f%%\n", step, liveBlocks, liveBytes, stats.footprint, stats.freebytes, stats.largestfree, 100.0 * stats.fragmentation);
+            }
+        }
+    }
+    if (strcmp(format, "json") == 0) {
+        fprintf(out, "]\n");
+    }
+
+    /* everything handed out has to come back */
+    for (int i = 0; i < STRESS_SLOTS; i++) {
+        if (stressBlocks[i].ptr != NULL) {
+            free(stressBlocks[i].ptr);
+            stressBlocks[i].ptr = NULL;
+        }
+    }
+    if (mymalloc_check() != 0) {
+        return stressFailed(numSteps, "Inconsistent heap after freeing every block");
+    }
+    if (mymalloc_stats().inuse != startInUse) {
+        return stressFailed(numSteps, "Bytes still counted in use after freeing every block");
+    }
+
+    /* blocks freed by threads that are exiting must go back to the heap, and be counted, too */
+    stats = mymalloc_stats();
+    pthread_key_create(&stressKey, stressExitFree);
+    for (int i = 0; i < STRESS_EXITING_THREADS; i++) {
+        pthread_create(&exitingThreads[i], NULL, stressExitingThread, NULL);
+    }
+    for (int i = 0; i < STRESS_EXITING_THREADS; i++) {
+        pthread_join(exitingThreads[i], NULL);
+    }
+    pthread_key_delete(stressKey);
+    if (mymalloc_stats().freebytes < stats.freebytes) {
+        return stressFailed(numSteps, "Blocks freed by exiting threads not returned to the heap");
+    } else if (mymalloc_stats().inuse != startInUse) {
+        return stressFailed(numSteps, "Bytes freed by exiting threads still counted in use");
+    }
+    return 1;
+}
+
+/**
+ * Prints how to run memgrind.
+ * @param[in] program name
+ */
+void printUsage (char *program) {
+    printf("Usage: %s [-r runs] [-W warmups] [-w workloads] [-p workload=param]... [-t max threads] [-o text|csv|json] [-f output file]\n"
+           "       [-T trace to record] [-R trace to replay] [-P policies] [-S stress steps] [-s seed]\n", program);
+    printf("  -r  measured runs per workload (default 50)\n");
+    printf("  -W  untimed warmup runs per workload (default 5)\n");
+    printf("  -w  workloads to run, e.g. ABG (default ABCDEFGHIJK, or R when replaying a trace)\n");
+    printf("  -p  parameter of one workload, e.g. -p A=120 (iterations; rounds per thread for F; realloc calls for G; requests for H and I; blocks for J; blocks replaced for K; replays per run for R)\n");
+    printf("  -t  workloadF runs with 1 up to this many threads (default: number of cores, at most %d)\n", MAX_WORKLOADF_THREADS);
+    printf("  -o  output format (default text)\n");
+    printf("  -f  write results to this file instead of stdout, keeping them apart from allocator error messages\n");
+    printf("  -T  record every allocator call the workloads make into a trace file\n");
+    printf("  -R  replay a trace file as workload R, reporting its throughput, peak footprint and fragmentation\n");
+    printf("  -P  run the workloads once with each of these placement policies: b (best-fit), f (first-fit), n (next-fit), e.g. -P bfn\n");
+    printf("  -S  run this many steps of the stress test instead of the workloads, checking the heap after every step and reporting fragmentation over time\n");
+    printf("  -s  seed of the stress test (default 1)\n");
+}
+
+/**
+ * Main function is the entry point into the program. It runs the selected workloads through the benchmark harness
+ * and reports, for each, the mean runtime, throughput and per-operation latency percentiles, either for people to
+ * read or as CSV or JSON so results can be compared between builds. Traces recorded from real programs can be replayed
+ * as workload R to judge the allocator on real traffic, and the stress test (-S) checks the heap after every call
+ * of a long random mix to validate changes to the allocator. Users are also able to create their own workloads,
+ * and print out the simulated memory, as well as the MetaData linked list using functions printMemory() and
+ * printMetaData() to see how the memory is being handled after each call to malloc() and free() functions.
  */
 int main (int argc, char** argv) {
-    int numWorkloadIterations = 50; // defined in specification
-
-    /* arrays storing each workloads run times to calculate mean after populated */
-    long workloadATimes[numWorkloadIterations];
-    long workloadBTimes[numWorkloadIterations];
-    long workloadCTimes[numWorkloadIterations];
-    long workloadDTimes[numWorkloadIterations];
-    long workloadETimes[numWorkloadIterations];
-
-    /* running each workload numWorkloadIterations times one after the other */
-    for (int i = 0; i < numWorkloadIterations; i++) {
-        workloadATimes[i] = workloadA(120);
-        workloadBTimes[i] = workloadB(120);
-        workloadCTimes[i] = workloadC(240);                
-        workloadDTimes[i] = workloadD(120);
-        workloadETimes[i] = workloadE();
-    }
-
-    /* print statements consecutively after calling workloads in case errors occur, which will be printed before mean times */
-    printf("----------------------------------------------------\n");
-    printf("Mean Workload A Runtime: %lu microseconds\n", calculateMeanTime(workloadATimes, numWorkloadIterations));    
-    printf("Mean Workload B Runtime: %lu microseconds\n", calculateMeanTime(workloadBTimes, numWorkloadIterations));    
-    printf("Mean Workload C Runtime: %lu microseconds\n", calculateMeanTime(workloadCTimes, numWorkloadIterations));    
-    printf("Mean Workload D Runtime: %lu microseconds\n", calculateMeanTime(workloadDTimes, numWorkloadIterations));    
-    printf("Mean Workload E Runtime: %lu microseconds\n", calculateMeanTime(workloadETimes, numWorkloadIterations));    
-    printf("----------------------------------------------------\n");
-
-
-    /* uncomment code below if calling printMetaData() from workloadE for a cleaner look, as well as comment prior call to workloadE in above code */
-    // for (int i = 0; i < numWorkloadIterations; i++) {
-    //     workloadETimes[i] = workloadE();
-    // }
-    // printf("Mean Workload E Runtime: %lu microseconds\n", calculateMeanTime(workloadETimes, numWorkloadIterations));    
+    Workload workloads[] = {
+        { 'A', workloadA, 120 },
+        { 'B', workloadB, 120 },
+        { 'C', workloadC, 240 },
+        { 'D', workloadD, 120 },
+        { 'E', workloadE, 1 },
+        { 'F', workloadF, 100000 },
+        { 'G', workloadG, 200 },
+        { 'H', workloadH, 100 },
+        { 'I', workloadI, 100 },
+        { 'J', workloadJ, 120 },
+        { 'K', workloadK, 2000 },
+        { 'R', workloadR, 1 },
+    };
+    int numWorkloads = sizeof(workloads) / sizeof(workloads[0]);
+    int numRuns = 50; // defined in specification
+    int numWarmups = 5;
+    char *selected = NULL;
+    char *format = "text";
+    char *outputPath = NULL;
+    char *recordPath = NULL;
+    char *replayPath = NULL;
+    char *policies = NULL;
+    int policy = 0;
+    long stressSteps = 0;
+    unsigned int seed = 1;
+    FILE *out = stdout;
+    int maxThreads = 0;
+    Result results[NUM_POLICIES * (sizeof(workloads) / sizeof(workloads[0]) + MAX_WORKLOADF_THREADS)];
+    int numResults = 0;
+    int option = 0;
+    char name = 0;
+    int param = 0;
+    int found = 0;
+
+    while ((option = getopt(argc, argv, "r:W:w:p:t:o:f:T:R:P:S:s:h")) != -1) {
+        switch (option) {
+            case 'r': numRuns = atoi(optarg); break;
+            case 'W': numWarmups = atoi(optarg); break;
+            case 'w': selected = optarg; break;
+            case 't': maxThreads = atoi(optarg); break;
+            case 'o': format = optarg; break;
+            case 'f': outputPath = optarg; break;
+            case 'T': recordPath = optarg; break;
+            case 'R': replayPath = optarg; break;
+            case 'P': policies = optarg; break;
+            case 'S': stressSteps = atol(optarg); break;
+            case 's': seed = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'p':
+                found = 0;
+                if (sscanf(optarg, "%c=%d", &name, &param) == 2 && param >= 0) {
+                    for (int i = 0; i < numWorkloads; i++) {
+                        if (workloads[i].name == name) {
+                            workloads[i].param = param;
+                            found = 1;
+                        }
+                    }
+                }
+                if (!found) {
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                printUsage(argv[0]);
+                return (option == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (numRuns < 1 || numWarmups < 0 || stressSteps < 0 ||
+        (policies != NULL && (policies[0] == '\0' || strspn(policies, "bfn") != strlen(policies) || strlen(policies) > NUM_POLICIES)) ||
+        (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0 && strcmp(format, "json") != 0)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (selected == NULL) {
+        selected = (replayPath != NULL) ? "R" : "ABCDEFGHIJK";
+    }
+    if (strchr(selected, 'R') != NULL && replayPath == NULL) {
+        printf("Workload R needs a trace to replay, given with -R\n");
+        return EXIT_FAILURE;
+    }
+    if (replayPath != NULL && !loadTrace(replayPath, &replay)) {
+        return EXIT_FAILURE;
+    }
+    if (recordPath != NULL && !mymalloc_trace_start(recordPath)) {
+        printf("Could not open %s for writing\n", recordPath);
+        return EXIT_FAILURE;
+    }
+    if (outputPath != NULL) {
+        out = fopen(outputPath, "w");
+        if (out == NULL) {
+            printf("Could not open %s for writing\n", outputPath);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* the stress test runs on its own, its samples are the results */
+    if (stressSteps > 0) {
+        found = runStress(out, format, stressSteps, seed);
+        mymalloc_trace_stop();
+        if (out != stdout) {
+            fclose(out);
+        }
+        return found ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* workloadF: multithreaded throughput for 1 up to the number of available cores */
+    if (maxThreads < 1) {
+        maxThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    maxThreads = (maxThreads < 1) ? 1 : ((maxThreads > MAX_WORKLOADF_THREADS) ? MAX_WORKLOADF_THREADS : maxThreads);
+
+    /* the harness' own buffer comes from the system allocator so it does not disturb the heap being measured */
+    latencySamples = (unsigned int*) (malloc)(MAX_LATENCY_SAMPLES * sizeof(unsigned int));
+    if (latencySamples == NULL) {
+        printf("Not enough memory for latency samples\n");
+        return EXIT_FAILURE;
+    }
 
+    /* running each selected workload one after the other, errors they cause are printed as they happen */
+    comparingPolicies = (policies != NULL);
+    for (int p = 0; p < (comparingPolicies ? (int) strlen(policies) : 1); p++) {
+        if (comparingPolicies) {
+            policy = (policies[p] == 'f') ? MYMALLOC_FIRST_FIT : (policies[p] == 'n') ? MYMALLOC_NEXT_FIT : MYMALLOC_BEST_FIT;
+            mymalloc_set_policy(policy);
+        }
+        for (int i = 0; i < numWorkloads; i++) {
+            if (strchr(selected, workloads[i].name) == NULL) {
+                continue;
+            }
+            if (workloads[i].name == 'F') {
+                for (workloadFThreads = 1; workloadFThreads <= maxThreads; workloadFThreads++) {
+                    results[numResults++] = runWorkload(&workloads[i], numWarmups, numRuns);
+                }
+            } else {
+                results[numResults++] = runWorkload(&workloads[i], numWarmups, numRuns);
+            }
+        }
+    }
+    mymalloc_trace_stop();
+
+    printResults(out, format, results, numResults);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    /* call printMetaData() here to see the state of the heap after all workloads */
+    // printMetaData();
+
+    (free)(latencySamples);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -7,170 +7,3216 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include "mymalloc.h"
 
-static char myblock[MYBLOCK_SIZE]; // array simluating main memory
+#define ALIGN_UP(value, alignment) (((uintptr_t) (value) + (alignment) - 1) & ~(uintptr_t) ((alignment) - 1)) // alignment must be a power of two
+#define BLOCK_SIZE(size) (ALIGN_UP((size) + METADATA_SIZE, SIZE_GRANULE) - METADATA_SIZE) // user data block size holding size bytes
+#define MIN_HEAP_BLOCK BLOCK_SIZE(SLAB_MAX_SIZE + 1) // smallest used heap block, so thread caches never mix heap blocks with slab objects
+
+static char myblock[MYBLOCK_SIZE] __attribute__((aligned(SIZE_GRANULE))); // array simluating main memory, the first heap chunk
+static unsigned char myblockstarts[MYBLOCK_SIZE / SIZE_GRANULE / 8]; // block start bitmap of myblock
+static pthread_mutex_t heaplock = PTHREAD_MUTEX_INITIALIZER; // guards every heap chunk, the page map and the bins
+static int heapready = 0; // set once the MetaData linked list has been initialized, read without heaplock by myfree()
+
+/**
+ * Prints the message for an invalid call. The preloadable library (built with MYMALLOC_PRELOAD) formats it on
+ * the stack and writes it to stderr instead, since stdio may call malloc() itself and the program's own stdout
+ * is not ours to write to. Marked cold so the compiler moves every error branch out of the hot paths.
+ * Building with MYMALLOC_NO_DIAGNOSTICS drops the messages altogether; invalid calls still fail the same way.
+ * @param[in] printf() format of the message
+ */
+#ifdef MYMALLOC_NO_DIAGNOSTICS
+#define reportError(...) ((void) 0)
+#else
+static void reportError (const char *format, ...) __attribute__((format(printf, 1, 2), cold, noinline));
+
+static void reportError (const char *format, ...) {
+    va_list args;
+#ifdef MYMALLOC_PRELOAD
+    char message[512];
+    int length = 0;
+
+    va_start(args, format);
+    length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length > 0) {
+        length = (length < (int) sizeof(message)) ? length : (int) sizeof(message) - 1;
+        if (write(STDERR_FILENO, message, (size_t) length) < 0) {
+            return; // nowhere left to report to
+        }
+    }
+#else
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+#endif
+}
+#endif
 
 /**
  * MetaData is the node container which provides information about its respective user data block.
+ * Nodes sit back to back in myblock, so the next node is always found right after the current user
+ * data block. A node is only 8 bytes: user data block sizes are kept at 8 more than a multiple of
+ * SIZE_GRANULE, which leaves the low bits of blockinfo free for the status of the node and of the
+ * physically previous one. A free block also stores its size in its last bytes (its footer), so
+ * myfree() can reach and merge with both neighbours without walking the list. checksum guards the
+ * node against stray writes so myfree() can trust it without walking the list either.
+ * Nodes sit 8 bytes before a SIZE_GRANULE boundary, so user data stays SIZE_GRANULE aligned.
  */ 
 typedef struct MetaData {
-    char blockstatus; // used = 'U' / free = 'F'
-    unsigned int blocklength; // user defined data memory block size
-    struct MetaData *next; // pointer to next MetaData node
+    unsigned int blockinfo; // user data block size, with BLOCK_USED and PREV_USED in its low bits
+    unsigned int checksum; // METADATA_MAGIC mixed with the node address, size and BLOCK_USED
 } MetaData;
 
+#define BLOCK_USED 1u // the user data block is handed out (or is a fence)
+#define PREV_USED 2u // the physically previous block is handed out, or there is none
+#define BLOCK_FLAGS 7u // low bits of blockinfo that are not part of the size
+
+/**
+ * Chunk describes one region of memory the allocator owns. Heap chunks ('H') hold a MetaData linked list
+ * that ends in a zero length fence node; the first one is myblock and the rest are CHUNK_SIZE mappings
+ * obtained with mmap. Large chunks ('L') are dedicated mappings holding a single used MetaData node.
+ * Slab chunks ('S') are CHUNK_SIZE mappings cut into equal objects of one slab class, with no MetaData
+ * at all; an occupancy bitmap tells which objects are handed out.
+ * Mapped chunks keep their Chunk at the start of the mapping; myblock's lives in mainchunk.
+ */
+typedef struct Chunk {
+    char kind; // heap chunk = 'H' / large chunk = 'L' / slab chunk = 'S'
+    size_t length; // bytes mapped, 0 for myblock which is never unmapped
+    struct Chunk *nextchunk; // next chunk of the same kind (and slab class), used to walk all of them
+    struct Chunk *prevchunk; // previous chunk of the same kind (and slab class)
+    MetaData *first; // first MetaData node
+    char *end; // end of the MetaData list, where a heap chunk's fence node sits, or end of the slab objects
+    unsigned char *blockstarts; // one bit per granule from first, set where a MetaData node starts
+    char *objects; // slab chunk: first object
+    unsigned long long *occupancy; // slab chunk: one bit per object, set while it is handed out
+    unsigned int objectsize; // slab chunk: bytes per object
+    unsigned int objectcount; // slab chunk: number of objects
+    unsigned int freeobjects; // slab chunk: number of objects not handed out
+    unsigned int searchword; // slab chunk: occupancy word to start looking for a free object in
+} Chunk;
+
+#define CHUNK_BITMAP_SIZE (CHUNK_SIZE / SIZE_GRANULE / 8) // block start bitmap bytes of a mapped heap chunk
+
+static Chunk mainchunk; // describes myblock
+static Chunk *heapchunks = NULL; // list of every heap chunk, most recently mapped first
+static Chunk *sparechunk = NULL; // empty heap chunk kept mapped to absorb the next growth
+static size_t pagesize = 0;
+static size_t mappedbytes = MYBLOCK_SIZE; // bytes the allocator holds: myblock plus every chunk mapping
+
+/**
+ * The page map finds the Chunk owning any address in constant time. Memory is split into CHUNK_SIZE units
+ * and every unit a chunk overlaps points back to it. It is a two level radix table so only the leaves for
+ * address ranges actually in use get mapped. Entries are written under heaplock but read without it.
+ */
+#define PAGEMAP_LEAF_BITS 16
+#define PAGEMAP_ROOT_SIZE (1UL << (48 - CHUNK_SHIFT - PAGEMAP_LEAF_BITS)) // covers a 48-bit address space
+
+static Chunk **pagemap[PAGEMAP_ROOT_SIZE];
+
+/**
+ * Looks up the chunk owning an address.
+ * @param[in] any address
+ * @param[out] owning Chunk, or NULL if the address is not in memory managed by mymalloc()
+ */
+static Chunk* chunkOf (void *addr) {
+    uintptr_t unit = (uintptr_t) addr >> CHUNK_SHIFT;
+    Chunk **leaf = NULL;
+
+    if ((unit >> PAGEMAP_LEAF_BITS) >= PAGEMAP_ROOT_SIZE) {
+        return NULL;
+    }
+    leaf = __atomic_load_n(&pagemap[unit >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return NULL;
+    }
+
+    return __atomic_load_n(&leaf[unit & ((1UL << PAGEMAP_LEAF_BITS) - 1)], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Points every page map unit overlapping [start, start + length) at the given chunk. Caller must hold heaplock.
+ * @param[in] start address of the range
+ * @param[in] length of the range in bytes
+ * @param[in] owning Chunk, or NULL to forget the range
+ * @param[out] 1 on success, 0 if a page map leaf could not be mapped
+ */
+static int pagemapSet (void *start, size_t length, Chunk *chunk) {
+    uintptr_t unit = (uintptr_t) start >> CHUNK_SHIFT;
+    uintptr_t lastunit = ((uintptr_t) start + length - 1) >> CHUNK_SHIFT;
+    Chunk **leaf = NULL;
+
+    for (; unit <= lastunit; unit++) {
+        if ((unit >> PAGEMAP_LEAF_BITS) >= PAGEMAP_ROOT_SIZE) {
+            return 0;
+        }
+        leaf = pagemap[unit >> PAGEMAP_LEAF_BITS];
+        if (leaf == NULL) {
+            leaf = mmap(NULL, sizeof(Chunk*) << PAGEMAP_LEAF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (leaf == MAP_FAILED) {
+                return 0;
+            }
+            __atomic_store_n(&pagemap[unit >> PAGEMAP_LEAF_BITS], leaf, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&leaf[unit & ((1UL << PAGEMAP_LEAF_BITS) - 1)], chunk, __ATOMIC_RELEASE);
+    }
+
+    return 1;
+}
+
+/**
+ * Maps fresh memory aligned to CHUNK_SIZE, so that a chunk never shares a page map unit with another one.
+ * @param[in] bytes to map (a multiple of the page size)
+ * @param[out] start of the mapping, or NULL if the system is out of memory
+ */
+static void* mapAligned (size_t length) {
+    char *raw = mmap(NULL, length + CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *aligned = NULL;
+
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    // trim the slack before and after the aligned range
+    aligned = (char*) ALIGN_UP(raw, CHUNK_SIZE);
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (aligned + length != raw + length + CHUNK_SIZE) {
+        munmap(aligned + length, (raw + length + CHUNK_SIZE) - (aligned + length));
+    }
+
+    __atomic_fetch_add(&mappedbytes, length, __ATOMIC_RELAXED);
+    return aligned;
+}
+
+/**
+ * Hands a mapping obtained with mapAligned() back to the system.
+ * @param[in] start of the mapping
+ * @param[in] bytes mapped
+ */
+static void unmapAligned (void *start, size_t length) {
+    munmap(start, length);
+    __atomic_fetch_sub(&mappedbytes, length, __ATOMIC_RELAXED);
+}
+
+/**
+ * Header helpers. blockinfo is accessed atomically because the PREV_USED bit of a used node is updated
+ * under heaplock by whichever thread frees or allocates its neighbour, while the node's owner may be
+ * reading it in myfree() without the lock. PREV_USED is left out of the checksum for the same reason.
+ */
+static unsigned int blockInfo (MetaData *node) {
+    return __atomic_load_n(&node->blockinfo, __ATOMIC_RELAXED);
+}
+
+static unsigned int blockLength (MetaData *node) {
+    return blockInfo(node) & ~BLOCK_FLAGS;
+}
+
+static int isUsed (MetaData *node) {
+    return (blockInfo(node) & BLOCK_USED) != 0;
+}
+
+/**
+ * Computes the checksum a MetaData node should carry for its address and blockinfo.
+ * @param[in] MetaData node
+ * @param[in] blockinfo of the node
+ * @param[out] expected checksum
+ */
+static unsigned int blockChecksum (MetaData *node, unsigned int info) {
+    return METADATA_MAGIC ^ (unsigned int) ((uintptr_t) node >> 3) ^ ((info & ~PREV_USED) * 0x9E3779B1u);
+}
+
+/**
+ * Sets all of blockinfo of a MetaData node and reseals its checksum.
+ * @param[in] MetaData node
+ * @param[in] user data block size
+ * @param[in] BLOCK_USED and PREV_USED bits
+ */
+static void setBlockInfo (MetaData *node, unsigned int length, unsigned int flags) {
+    __atomic_store_n(&node->blockinfo, length | flags, __ATOMIC_RELAXED);
+    node->checksum = blockChecksum(node, length | flags);
+}
+
+/**
+ * Sets the user data block size of a MetaData node, keeping its status bits, and reseals its checksum.
+ * @param[in] MetaData node
+ * @param[in] new user data block size
+ */
+static void setBlockLength (MetaData *node, unsigned int length) {
+    setBlockInfo(node, length, blockInfo(node) & BLOCK_FLAGS);
+}
+
+/**
+ * Marks a MetaData node used or free and reseals its checksum.
+ * @param[in] MetaData node
+ * @param[in] 1 for used, 0 for free
+ */
+static void setBlockUsed (MetaData *node, int used) {
+    unsigned int info = blockInfo(node);
+
+    setBlockInfo(node, info & ~BLOCK_FLAGS, used ? (info | BLOCK_USED) & BLOCK_FLAGS : info & BLOCK_FLAGS & ~BLOCK_USED);
+}
+
+/**
+ * Records whether the block physically before a MetaData node is used.
+ * @param[in] MetaData node
+ * @param[in] 1 for used, 0 for free
+ */
+static void setPrevUsed (MetaData *node, int used) {
+    if (used) {
+        __atomic_fetch_or(&node->blockinfo, PREV_USED, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&node->blockinfo, ~PREV_USED, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Side bitmap helpers recording which granules of a heap chunk hold the start of a MetaData node. A pointer
+ * handed to myfree() is only trusted if its MetaData node is marked here and its checksum matches.
+ * Bits are updated atomically because myfree() reads them without holding heaplock.
+ */
+static void markBlockStart (Chunk *chunk, MetaData *node) {
+    unsigned long granule = ((char*) node - (char*) chunk->first) / SIZE_GRANULE;
+    __atomic_fetch_or(&chunk->blockstarts[granule / 8], (unsigned char) (1 << (granule % 8)), __ATOMIC_RELAXED);
+}
+
+static void clearBlockStart (Chunk *chunk, MetaData *node) {
+    unsigned long granule = ((char*) node - (char*) chunk->first) / SIZE_GRANULE;
+    __atomic_fetch_and(&chunk->blockstarts[granule / 8], (unsigned char) ~(1 << (granule % 8)), __ATOMIC_RELAXED);
+}
+
+static int isBlockStart (Chunk *chunk, MetaData *node) {
+    unsigned long granule = ((char*) node - (char*) chunk->first) / SIZE_GRANULE;
+    return (__atomic_load_n(&chunk->blockstarts[granule / 8], __ATOMIC_RELAXED) >> (granule % 8)) & 1;
+}
+
+/**
+ * FreeLinks is stored in the user data block of every free MetaData node and links it into the
+ * segregated free list (bin) for its size class. Used blocks do not need it, so it costs no extra space.
+ */
+typedef struct FreeLinks {
+    MetaData *prevfree; // previous free node in the same bin
+    MetaData *nextfree; // next free node in the same bin
+} FreeLinks;
+
+#define LINKS(node) ((FreeLinks*) ((node) + 1)) // free list links live right after the MetaData node
+#define FOOTER(next) (((unsigned int*) (next))[-1]) // size of a free block, stored right before the node after it
+
+/**
+ * Linked list function to find the MetaData node physically after the given one.
+ * @param[in] MetaData node
+ * @param[out] next MetaData node, or NULL if node is the last one in its heap chunk
+ */
+static MetaData* nextBlock (MetaData *node) {
+    MetaData *next = (MetaData*) ((char*) (node + 1) + blockLength(node));
+
+    return (blockLength(next) == 0) ? NULL : next; // the fence node closing every heap chunk has no user data
+}
+
+/**
+ * Linked list function to find the MetaData node physically before the given one using the footer that
+ * block keeps while it is free.
+ * @param[in] MetaData node
+ * @param[out] previous MetaData node, or NULL if it is used or node is the first one in its heap chunk
+ */
+static MetaData* prevFreeBlock (MetaData *node) {
+    if (blockInfo(node) & PREV_USED) {
+        return NULL;
+    }
+
+    return (MetaData*) ((char*) node - FOOTER(node) - METADATA_SIZE);
+}
+
+/**
+ * Refreshes the boundary tags describing the given node: its footer if it is free, and the PREV_USED bit
+ * of the physically next node. Must be called whenever a node changes status or length.
+ * @param[in] MetaData node
+ */
+static void updateBoundaryTag (MetaData *node) {
+    MetaData *next = (MetaData*) ((char*) (node + 1) + blockLength(node));
+
+    if (!isUsed(node)) {
+        FOOTER(next) = blockLength(node);
+    }
+    if (blockLength(next) != 0) {
+        setPrevUsed(next, isUsed(node));
+    }
+}
+
+/**
+ * Segregated free lists. Small bins hold free blocks of exactly one size (one per SIZE_GRANULE), so a
+ * small request is served by popping the head of its bin. Large bins hold power-of-two size ranges and are
+ * searched best-fit. binmap has bit i set whenever bins[i] is non-empty, so the next usable bin is one bit scan away.
+ */
+static MetaData *bins[NUM_BINS];
+static unsigned long long binmap = 0;
+static size_t binbytes = 0; // user data bytes of every block in the bins, for mymalloc_stats()
+static size_t bincount = 0; // number of blocks in the bins
+
+/**
+ * Placement policy binFind() follows, see MYMALLOC_BEST_FIT. Best-fit gets the most out of the bins, since they
+ * already index free blocks by size. First-fit and next-fit go through every free block large enough, in address
+ * order from the lowest address or from where the last block was carved (nextfitrover), and are there to compare
+ * against. Read and written under heaplock.
+ */
+#ifndef MYMALLOC_DEFAULT_POLICY
+#define MYMALLOC_DEFAULT_POLICY MYMALLOC_BEST_FIT
+#endif
+
+static int placementpolicy = MYMALLOC_DEFAULT_POLICY;
+static uintptr_t nextfitrover = 0; // only compared against, the block there may be long gone
+
+/**
+ * Maps a user data block size to the bin it belongs to.
+ * @param[in] user data block size (see BLOCK_SIZE, at least MIN_BLOCK_SIZE)
+ * @param[out] bin index in [0, NUM_BINS)
+ */
+static unsigned int binIndex (unsigned int size) {
+    unsigned int index;
+
+    if (size < SMALL_BIN_LIMIT) {
+        return size / SIZE_GRANULE;
+    }
+
+    // one large bin per power of two starting at SMALL_BIN_LIMIT
+    index = NUM_SMALL_BINS + (31 - __builtin_clz(size)) - (31 - __builtin_clz(SMALL_BIN_LIMIT));
+    return (index < NUM_BINS) ? index : NUM_BINS - 1;
+}
+
+/**
+ * Pushes a free MetaData node onto the front of its bin.
+ * @param[in] free MetaData node
+ */
+static void binInsert (MetaData *node) {
+    unsigned int index = binIndex(blockLength(node));
+
+    LINKS(node)->prevfree = NULL;
+    LINKS(node)->nextfree = bins[index];
+    if (bins[index] != NULL) {
+        LINKS(bins[index])->prevfree = node;
+    }
+    bins[index] = node;
+    binmap |= (1ULL << index);
+    binbytes += blockLength(node);
+    bincount++;
+}
+
+/**
+ * Unlinks a free MetaData node from its bin.
+ * @param[in] free MetaData node currently stored in a bin
+ */
+static void binRemove (MetaData *node) {
+    unsigned int index = binIndex(blockLength(node));
+    FreeLinks *links = LINKS(node);
+
+    if (links->prevfree != NULL) {
+        LINKS(links->prevfree)->nextfree = links->nextfree;
+    } else {
+        bins[index] = links->nextfree;
+    }
+    if (links->nextfree != NULL) {
+        LINKS(links->nextfree)->prevfree = links->prevfree;
+    }
+
+    if (bins[index] == NULL) {
+        binmap &= ~(1ULL << index);
+    }
+    binbytes -= blockLength(node);
+    bincount--;
+}
+
+/**
+ * Finds the free MetaData node large enough for the requested size that comes first in address order from
+ * the given address, wrapping around to the lowest address if there is none after it.
+ * @param[in] user requested size (already rounded up)
+ * @param[in] address to start from, 0 for the lowest
+ * @param[out] free MetaData node with blocklength >= size, or NULL if no bin can satisfy the request
+ */
+static MetaData* binFindAddressed (unsigned int size, uintptr_t from) {
+    unsigned long long candidates = binmap & (~0ULL << binIndex(size));
+    MetaData *after = NULL; // lowest fitting node at or after from
+    MetaData *lowest = NULL; // lowest fitting node
+    MetaData *curr = NULL;
+
+    for (; candidates != 0; candidates &= candidates - 1) {
+        for (curr = bins[__builtin_ctzll(candidates)]; curr != NULL; curr = LINKS(curr)->nextfree) {
+            if (blockLength(curr) < size) {
+                continue;
+            }
+            if (lowest == NULL || curr < lowest) {
+                lowest = curr;
+            }
+            if ((uintptr_t) curr >= from && (after == NULL || curr < after)) {
+                after = curr;
+            }
+        }
+    }
+
+    return (after != NULL) ? after : lowest;
+}
+
+/**
+ * Finds and unlinks the free MetaData node the placement policy picks for the requested size. For best-fit,
+ * small bins are exact so their head is taken as is; large bins are scanned for the smallest block that still fits.
+ * @param[in] user requested size (already rounded up)
+ * @param[out] free MetaData node with blocklength >= size, or NULL if no bin can satisfy the request
+ */
+static MetaData* binFind (unsigned int size) {
+    unsigned int index = binIndex(size);
+    unsigned long long candidates;
+    MetaData *best = NULL;
+    MetaData *curr = NULL;
+
+    if (placementpolicy != MYMALLOC_BEST_FIT) {
+        best = binFindAddressed(size, (placementpolicy == MYMALLOC_NEXT_FIT) ? nextfitrover : 0);
+        if (best == NULL) {
+            return NULL;
+        }
+        nextfitrover = (uintptr_t) best + METADATA_SIZE + size; // where the rest of the block will be left
+        binRemove(best);
+        return best;
+    }
+
+    /* the request's own bin: exact for small sizes, best-fit scan for large ones */
+    if (index >= NUM_SMALL_BINS) {
+        for (curr = bins[index]; curr != NULL; curr = LINKS(curr)->nextfree) {
+            if (blockLength(curr) >= size && (best == NULL || blockLength(curr) < blockLength(best))) {
+                best = curr;
+            }
+        }
+    } else {
+        best = bins[index];
+    }
+
+    /* otherwise every block in the next non-empty bin is large enough */
+    if (best == NULL) {
+        candidates = (index + 1 < NUM_BINS) ? (binmap & (~0ULL << (index + 1))) : 0;
+        if (candidates == 0) {
+            return NULL;
+        }
+        index = __builtin_ctzll(candidates);
+        best = bins[index];
+        if (index >= NUM_SMALL_BINS) {
+            for (curr = LINKS(best)->nextfree; curr != NULL; curr = LINKS(curr)->nextfree) {
+                if (blockLength(curr) < blockLength(best)) {
+                    best = curr;
+                }
+            }
+        }
+    }
+
+    binRemove(best);
+    return best;
+}
+
+/**
+ * Linked list function to coalesce a newly freed user data block with its free neighbours. Thanks to the
+ * boundary tags both neighbours are found directly, so this costs the same no matter how long the list is.
+ * Doing so provides the user with the most amount of data to allocate.
+ * @param[in] MetaData node that was just marked free and is not in any bin yet
+ * @param[out] MetaData node of the merged free block
+ */ 
+static MetaData* coalesce (MetaData *node) {
+    Chunk *chunk = chunkOf(node);
+    MetaData *next = nextBlock(node);
+    MetaData *prev = prevFreeBlock(node);
+
+    if (next != NULL && !isUsed(next)) { // absorb the following free block
+        binRemove(next);
+        clearBlockStart(chunk, next);
+        setBlockLength(node, blockLength(node) + blockLength(next) + METADATA_SIZE);
+    }
+
+    if (prev != NULL) { // let the preceding free block absorb this one
+        binRemove(prev);
+        clearBlockStart(chunk, node);
+        setBlockLength(prev, blockLength(prev) + blockLength(node) + METADATA_SIZE);
+        node = prev;
+    }
+
+    updateBoundaryTag(node);
+    return node;
+}
+
+/**
+ * Lays out an empty MetaData linked list over a heap chunk: one free node spanning everything, closed by
+ * a zero length fence node, and files the free node in the bins. Caller must hold heaplock.
+ * @param[in] heap chunk with first, end and blockstarts set
+ */
+static void chunkInitList (Chunk *chunk) {
+    MetaData *head = chunk->first; // head pointer to linked list in the chunk
+    MetaData *fence = (MetaData*) chunk->end;
+
+    setBlockInfo(head, (unsigned int) (chunk->end - (char*) (head + 1)), PREV_USED); // free, with nothing before it
+    markBlockStart(chunk, head);
+
+    setBlockInfo(fence, 0, BLOCK_USED);
+    updateBoundaryTag(head);
+
+    binInsert(head);
+}
+
+/**
+ * Links a heap chunk into the list of heap chunks and makes its addresses known to the page map.
+ * Caller must hold heaplock.
+ * @param[in] heap chunk
+ * @param[in] start of the memory it covers
+ * @param[in] bytes it covers
+ * @param[out] 1 on success, 0 if the page map could not grow
+ */
+static int chunkRegister (Chunk *chunk, void *start, size_t length) {
+    if (!pagemapSet(start, length, chunk)) {
+        return 0;
+    }
+
+    chunk->prevchunk = NULL;
+    chunk->nextchunk = heapchunks;
+    if (heapchunks != NULL) {
+        heapchunks->prevchunk = chunk;
+    }
+    heapchunks = chunk;
+    return 1;
+}
+
+/**
+ * Sets up myblock as the first heap chunk. Caller must hold heaplock.
+ */
+static void heapInit () {
+    char *tracepath = getenv("MYMALLOC_TRACE");
+    char *profiletop = getenv("MYMALLOC_PROFILE");
+    char *policy = getenv("MYMALLOC_POLICY");
+
+    pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    if (tracepath != NULL && tracepath[0] != '\0') {
+        mymalloc_trace_start(tracepath);
+    }
+    if (profiletop != NULL && profiletop[0] != '\0') {
+        mymalloc_profile_start((atoi(profiletop) > 0) ? atoi(profiletop) : PROFILE_DEFAULT_TOP);
+    }
+    if (policy != NULL && policy[0] != '\0') {
+        if (strcmp(policy, "first") == 0) {
+            placementpolicy = MYMALLOC_FIRST_FIT;
+        } else if (strcmp(policy, "next") == 0) {
+            placementpolicy = MYMALLOC_NEXT_FIT;
+        } else if (strcmp(policy, "best") == 0) {
+            placementpolicy = MYMALLOC_BEST_FIT;
+        } else {
+            reportError("Malloc Error: MYMALLOC_POLICY should be best, first or next, not %s\n", policy);
+        }
+    }
+
+    mainchunk.kind = 'H';
+    mainchunk.length = 0;
+    mainchunk.first = ((MetaData*) (myblock + SIZE_GRANULE)) - 1; // pointing head pointer of MetaData linked list to the start of myblock, leaving user data aligned
+    mainchunk.end = myblock + MYBLOCK_SIZE - METADATA_SIZE;
+    mainchunk.blockstarts = myblockstarts;
+    if (!chunkRegister(&mainchunk, myblock, MYBLOCK_SIZE)) {
+        return;
+    }
+
+    chunkInitList(&mainchunk);
+    __atomic_store_n(&heapready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Grows the heap by one CHUNK_SIZE heap chunk mapped with mmap and files its free space in the bins.
+ * Caller must hold heaplock.
+ * @param[out] 1 if the heap grew, 0 if the system is out of memory
+ */
+static int heapGrow () {
+    Chunk *chunk = mapAligned(CHUNK_SIZE);
+
+    if (chunk == NULL) {
+        return 0;
+    }
+
+    chunk->kind = 'H';
+    chunk->length = CHUNK_SIZE;
+    chunk->blockstarts = (unsigned char*) (chunk + 1);
+    chunk->first = ((MetaData*) ALIGN_UP(chunk->blockstarts + CHUNK_BITMAP_SIZE + METADATA_SIZE, SIZE_GRANULE)) - 1;
+    chunk->end = (char*) chunk + CHUNK_SIZE - METADATA_SIZE;
+    if (!chunkRegister(chunk, chunk, CHUNK_SIZE)) {
+        unmapAligned(chunk, CHUNK_SIZE);
+        return 0;
+    }
+
+    chunkInitList(chunk);
+    return 1;
+}
+
+/**
+ * Deals with a mapped heap chunk that has become entirely free. One such chunk is kept as a spare with its
+ * pages handed back through madvise(MADV_DONTNEED), so a workload hovering around a chunk boundary does not
+ * map and unmap over and over; any other empty chunk is unmapped. Caller must hold heaplock.
+ * @param[in] empty heap chunk
+ * @param[in] its only MetaData node, free and not in any bin
+ * @param[out] 1 if the chunk was unmapped, 0 if it was kept and node still has to be put in the bins
+ */
+static int chunkRelease (Chunk *chunk, MetaData *node) {
+    char *pagestart = NULL;
+    char *pageend = NULL;
+
+    if (sparechunk != NULL && sparechunk != chunk && !isUsed(sparechunk->first) && nextBlock(sparechunk->first) == NULL) {
+        if (chunk->prevchunk != NULL) {
+            chunk->prevchunk->nextchunk = chunk->nextchunk;
+        } else {
+            heapchunks = chunk->nextchunk;
+        }
+        if (chunk->nextchunk != NULL) {
+            chunk->nextchunk->prevchunk = chunk->prevchunk;
+        }
+        pagemapSet(chunk, chunk->length, NULL);
+        unmapAligned(chunk, chunk->length);
+        return 1;
+    }
+
+    // keep the pages holding the MetaData, its FreeLinks and the fence; release everything in between
+    pagestart = (char*) ALIGN_UP(LINKS(node) + 1, pagesize);
+    pageend = (char*) ((uintptr_t) chunk->end & ~(uintptr_t) (pagesize - 1));
+    if (pagestart < pageend) {
+        madvise(pagestart, pageend - pagestart, MADV_DONTNEED);
+    }
+    sparechunk = chunk;
+    return 0;
+}
+
+static void heapFree (MetaData *node);
+
+/**
+ * Shrinks a used MetaData node to the given size, handing the tail back to the bins as a free block if it
+ * is big enough to stand on its own. Caller must hold heaplock.
+ * @param[in] used MetaData node
+ * @param[in] size to keep (see BLOCK_SIZE)
+ */
+static void splitBlock (MetaData *node, unsigned int size) {
+    MetaData *new_node = NULL; // new MetaData node holding the tail
+
+    if (blockLength(node) < size + METADATA_SIZE + MIN_BLOCK_SIZE) { // remainder is too small to stand as its own free block
+        return;
+    }
+
+    // new MetaData node is sitting at location: current MetaData address + kept size + METADATA_SIZE
+    // example: current MetaData at address 8
+    // user requested size is 100 bytes (rounded up to 104)
+    // METADATA_SIZE is 8 bytes
+    // new MetaData node is sitting at 8 + 104 + 8 = address 120
+    new_node = (MetaData*) (void*) ((char*) node + size + METADATA_SIZE);
+    setBlockInfo(new_node, blockLength(node) - size - METADATA_SIZE, BLOCK_USED | PREV_USED);
+    markBlockStart(chunkOf(new_node), new_node);
+    updateBoundaryTag(new_node);
+
+    setBlockLength(node, size);
+    heapFree(new_node); // merges with a free block that may follow
+}
+
+/**
+ * Carves a user data block of the given size out of the bins, mapping another heap chunk whenever the
+ * existing ones are full. Caller must hold heaplock and heapInit() must have run.
+ * @param[in] user requested size (already rounded up, below MMAP_THRESHOLD)
+ * @param[out] used MetaData node, or NULL if the system is out of memory
+ */
+static MetaData* heapAlloc (unsigned int size) {
+    MetaData *curr = NULL; // free MetaData node that will hold the user data
+
+    /* free blocks are already coalesced by myfree(), so the bins hold every block that could fit */
+    curr = binFind(size);
+    if (curr == NULL && heapGrow()) {
+        curr = binFind(size);
+    }
+    if (curr == NULL) {
+        return NULL;
+    }
+
+    setBlockUsed(curr, 1); // current MetaData block is occupied now
+    updateBoundaryTag(curr);
+    splitBlock(curr, size);
+
+    return curr;
+}
+
+/**
+ * Returns a used MetaData node to the bins, merging it with its free neighbours and giving the heap chunk
+ * back to the system if that leaves it empty. Caller must hold heaplock.
+ * @param[in] used MetaData node
+ */
+static void heapFree (MetaData *node) {
+    Chunk *chunk = NULL;
+
+    setBlockUsed(node, 0);
+    node = coalesce(node);
+
+    chunk = chunkOf(node);
+    if (node == chunk->first && nextBlock(node) == NULL) { // node spans its whole heap chunk
+        if (chunk != &mainchunk && chunkRelease(chunk, node)) {
+            return;
+        }
+    }
+
+    binInsert(node);
+}
+
+/**
+ * Carves a user data block whose address is a multiple of the given alignment. A block padded by the
+ * alignment is taken from the bins and the space in front of the aligned address is split off and freed
+ * again, as is any tail beyond the requested size. Caller must hold heaplock and heapInit() must have run.
+ * @param[in] user requested size (already rounded up)
+ * @param[in] alignment, a power of two larger than SIZE_GRANULE
+ * @param[out] used MetaData node, or NULL if the system is out of memory
+ */
+static MetaData* heapAllocAligned (unsigned int size, size_t alignment) {
+    MetaData *node = heapAlloc(size + alignment + METADATA_SIZE + MIN_BLOCK_SIZE);
+    MetaData *aligned = NULL; // MetaData node in front of the aligned user data
+    unsigned int leadlength = 0; // user data size of the block split off the front
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    aligned = ((MetaData*) ALIGN_UP(node + 1, alignment)) - 1;
+    if (aligned != node) {
+        // the space in front has to be able to stand as its own free block
+        if ((size_t) ((char*) aligned - (char*) node) < METADATA_SIZE + MIN_BLOCK_SIZE) {
+            aligned = (MetaData*) ((char*) aligned + alignment);
+        }
+        leadlength = (char*) aligned - (char*) (node + 1);
+
+        setBlockInfo(aligned, blockLength(node) - leadlength - METADATA_SIZE, BLOCK_USED | PREV_USED);
+        markBlockStart(chunkOf(aligned), aligned);
+        updateBoundaryTag(aligned);
+
+        setBlockLength(node, leadlength);
+        heapFree(node);
+    }
+
+    splitBlock(aligned, size);
+    return aligned;
+}
+
+/**
+ * Makes sure heapInit() has run, for paths that do not otherwise take heaplock.
+ */
+static void heapEnsureReady () {
+    if (__builtin_expect(!__atomic_load_n(&heapready, __ATOMIC_ACQUIRE), 0)) {
+        pthread_mutex_lock(&heaplock);
+        if (!heapready) {
+            heapInit();
+        }
+        pthread_mutex_unlock(&heaplock);
+    }
+}
+
+/**
+ * Serves a request of at least MMAP_THRESHOLD bytes with a dedicated mapping, which goes straight back to
+ * the system when freed.
+ * @param[in] user requested size (already rounded up)
+ * @param[in] alignment of the user data, a power of two of at least SIZE_GRANULE
+ * @param[out] used MetaData node, or NULL if the system is out of memory
+ */
+static MetaData* largeAlloc (size_t size, size_t alignment) {
+    size_t length = ALIGN_UP(sizeof(Chunk) + METADATA_SIZE + alignment + size, pagesize);
+    Chunk *chunk = mapAligned(length);
+    MetaData *node = NULL;
+    int registered = 0;
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->kind = 'L';
+    chunk->length = length;
+    chunk->nextchunk = NULL;
+    chunk->prevchunk = NULL;
+    chunk->first = ((MetaData*) ALIGN_UP((char*) (chunk + 1) + METADATA_SIZE, alignment)) - 1;
+    chunk->end = (char*) chunk + length;
+    chunk->blockstarts = NULL;
+
+    node = chunk->first;
+    setBlockInfo(node, (unsigned int) size, BLOCK_USED | PREV_USED);
+
+    pthread_mutex_lock(&heaplock);
+    registered = pagemapSet(chunk, length, chunk);
+    pthread_mutex_unlock(&heaplock);
+    if (!registered) {
+        unmapAligned(chunk, length);
+        return NULL;
+    }
+
+    return node;
+}
+
+/**
+ * Unmaps a large chunk handed out by largeAlloc().
+ * @param[in] large chunk
+ */
+static void largeFree (Chunk *chunk) {
+    pthread_mutex_lock(&heaplock);
+    pagemapSet(chunk, chunk->length, NULL);
+    pthread_mutex_unlock(&heaplock);
+    unmapAligned(chunk, chunk->length);
+}
+
+/**
+ * Shrinks a large chunk in place, unmapping the whole pages past the new end of its user data block.
+ * @param[in] large chunk
+ * @param[in] new user data block size (already rounded up, at least MMAP_THRESHOLD and at most the current one)
+ */
+static void largeShrink (Chunk *chunk, size_t size) {
+    MetaData *node = chunk->first;
+    size_t length = ALIGN_UP((char*) (node + 1) + size - (char*) chunk, pagesize); // bytes still needed
+    char *unit = (char*) ALIGN_UP((char*) chunk + length, CHUNK_SIZE); // first page map unit no longer used
+
+    setBlockLength(node, (unsigned int) size);
+    if (length >= chunk->length) {
+        return;
+    }
+
+    pthread_mutex_lock(&heaplock);
+    if (unit < (char*) chunk + chunk->length) {
+        pagemapSet(unit, (char*) chunk + chunk->length - unit, NULL);
+    }
+    pthread_mutex_unlock(&heaplock);
+    unmapAligned((char*) chunk + length, chunk->length - length);
+    chunk->length = length;
+    chunk->end = (char*) chunk + length;
+}
+
+/**
+ * Slabs serve every request of up to SLAB_MAX_SIZE bytes. Requests are rounded up to a power of two slab
+ * class and carved from a slab chunk of that class, so tiny objects carry no MetaData and a free object is
+ * found with a bit scan over the occupancy bitmap. Each class keeps its slabs in one list with the ones
+ * that still have free objects at the front.
+ */
+static Chunk *slabs[NUM_SLAB_CLASSES]; // slab chunks of each class, non-full ones first
+static unsigned int slabcounts[NUM_SLAB_CLASSES]; // number of slab chunks of each class
+static Chunk *slabspares[NUM_SLAB_CLASSES]; // empty slab chunk of each class kept mapped to absorb the next growth
+static size_t slabfreebytes = 0; // bytes of every slab object not handed out, for mymalloc_stats()
+
+/**
+ * Maps a request of up to SLAB_MAX_SIZE bytes to its slab class.
+ * @param[in] user requested size
+ * @param[out] slab class, objects of class c are (SLAB_MIN_SIZE << c) bytes
+ */
+static unsigned int slabClass (size_t size) {
+    if (size <= SLAB_MIN_SIZE) {
+        return 0;
+    }
+
+    return (31 - __builtin_clz((unsigned int) size - 1)) + 1 - (31 - __builtin_clz(SLAB_MIN_SIZE));
+}
+
+/**
+ * Slab chunk list helpers: unlink a slab from its class list, and put it back at the front (it has
+ * free objects) or at the back (it is full).
+ */
+static void slabUnlink (Chunk *slab, unsigned int class) {
+    if (slab->prevchunk != NULL) {
+        slab->prevchunk->nextchunk = slab->nextchunk;
+    } else {
+        slabs[class] = slab->nextchunk;
+    }
+    if (slab->nextchunk != NULL) {
+        slab->nextchunk->prevchunk = slab->prevchunk;
+    }
+}
+
+static void slabPushFront (Chunk *slab, unsigned int class) {
+    slab->prevchunk = NULL;
+    slab->nextchunk = slabs[class];
+    if (slabs[class] != NULL) {
+        slabs[class]->prevchunk = slab;
+    }
+    slabs[class] = slab;
+}
+
+static void slabPushBack (Chunk *slab, unsigned int class) {
+    Chunk *last = slabs[class];
+
+    slab->nextchunk = NULL;
+    if (last == NULL) {
+        slab->prevchunk = NULL;
+        slabs[class] = slab;
+        return;
+    }
+    while (last->nextchunk != NULL) {
+        last = last->nextchunk;
+    }
+    last->nextchunk = slab;
+    slab->prevchunk = last;
+}
+
+/**
+ * Maps a new slab chunk for one slab class and puts it at the front of that class. Caller must hold heaplock.
+ * @param[in] slab class
+ * @param[out] new slab chunk, or NULL if the system is out of memory
+ */
+static Chunk* slabCreate (unsigned int class) {
+    Chunk *slab = mapAligned(CHUNK_SIZE);
+    unsigned int objectsize = SLAB_MIN_SIZE << class;
+    unsigned int count = (CHUNK_SIZE - sizeof(Chunk)) / objectsize;
+    char *objects = NULL;
+
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    // the occupancy bitmap and the objects share the chunk, objects start on a cache line
+    do {
+        objects = (char*) ALIGN_UP((char*) (slab + 1) + ((count + 63) / 64) * sizeof(unsigned long long), 64);
+        if (objects + (size_t) count * objectsize <= (char*) slab + CHUNK_SIZE) {
+            break;
+        }
+        count--;
+    } while (1);
+
+    slab->kind = 'S';
+    slab->length = CHUNK_SIZE;
+    slab->first = NULL;
+    slab->blockstarts = NULL;
+    slab->occupancy = (unsigned long long*) (slab + 1);
+    slab->objects = objects;
+    slab->end = objects + (size_t) count * objectsize;
+    slab->objectsize = objectsize;
+    slab->objectcount = count;
+    slab->freeobjects = count;
+    slab->searchword = 0;
+    if (!pagemapSet(slab, CHUNK_SIZE, slab)) {
+        unmapAligned(slab, CHUNK_SIZE);
+        return NULL;
+    }
+
+    slabPushFront(slab, class);
+    slabcounts[class]++;
+    slabfreebytes += (size_t) count * objectsize;
+    return slab;
+}
+
+/**
+ * Hands out up to count objects of the slab class fitting the given size, all taken from one occupancy word
+ * so they are marked with a single atomic update. Caller must hold heaplock.
+ * @param[in] user requested size, at most SLAB_MAX_SIZE
+ * @param[in] most objects wanted, at least 1
+ * @param[in] where the objects are stored, in address order
+ * @param[out] number of objects handed out, 0 if the system is out of memory
+ */
+static size_t slabAllocRun (size_t size, size_t count, void **ptrs) {
+    unsigned int class = slabClass(size);
+    Chunk *slab = slabs[class];
+    unsigned long long freebits = 0;
+    unsigned long long taken = 0; // bits of the objects handed out
+    unsigned int word = 0;
+    unsigned int bit = 0;
+    size_t done = 0;
+
+    if (slab == NULL || slab->freeobjects == 0) {
+        slab = slabCreate(class);
+        if (slab == NULL) {
+            return 0;
+        }
+    }
+
+    // bits past objectcount are never set, but they are never free either
+    for (word = slab->searchword; ; word = (word + 1) % ((slab->objectcount + 63) / 64)) {
+        freebits = ~slab->occupancy[word];
+        if (word == (slab->objectcount - 1) / 64 && slab->objectcount % 64 != 0) {
+            freebits &= (1ULL << (slab->objectcount % 64)) - 1;
+        }
+        if (freebits != 0) {
+            break;
+        }
+    }
+    for (; freebits != 0 && done < count; freebits &= freebits - 1) {
+        bit = __builtin_ctzll(freebits);
+        taken |= 1ULL << bit;
+        ptrs[done++] = slab->objects + ((size_t) word * 64 + bit) * slab->objectsize;
+    }
+    __atomic_fetch_or(&slab->occupancy[word], taken, __ATOMIC_RELAXED);
+    slab->searchword = word;
+    slabfreebytes -= done * slab->objectsize;
+
+    slab->freeobjects -= (unsigned int) done;
+    if (slab->freeobjects == 0) { // full slabs go to the back so the front always has room
+        slabUnlink(slab, class);
+        slabPushBack(slab, class);
+    }
+
+    return done;
+}
+
+/**
+ * Hands out one object of the slab class fitting the given size. Caller must hold heaplock.
+ * @param[in] user requested size, at most SLAB_MAX_SIZE
+ * @param[out] pointer to the object, or NULL if the system is out of memory
+ */
+static void* slabAlloc (size_t size) {
+    void *ptr = NULL;
+
+    return slabAllocRun(size, 1, &ptr) ? ptr : NULL;
+}
+
+/**
+ * Returns objects sharing one occupancy word to their slab chunk. A slab that becomes empty is kept as its
+ * class' spare, like sparechunk for heap chunks, so a class hovering around a slab boundary does not map and
+ * unmap a slab on every call; it is only unmapped if the class already has an empty spare. Caller must hold heaplock.
+ * @param[in] slab chunk
+ * @param[in] occupancy word of the objects
+ * @param[in] bits of the objects within that word, all of them handed out
+ */
+static void slabFreeRun (Chunk *slab, size_t word, unsigned long long bits) {
+    unsigned int class = slabClass(slab->objectsize);
+    unsigned int count = (unsigned int) __builtin_popcountll(bits);
+    int wasfull = (slab->freeobjects == 0);
+
+    __atomic_fetch_and(&slab->occupancy[word], ~bits, __ATOMIC_RELAXED);
+    slabfreebytes += (size_t) count * slab->objectsize;
+    slab->freeobjects += count;
+    if (wasfull) { // it has room again
+        slabUnlink(slab, class);
+        slabPushFront(slab, class);
+    }
+
+    if (slab->freeobjects != slab->objectcount) {
+        return;
+    }
+    if (slabspares[class] == NULL || slabspares[class] == slab || slabspares[class]->freeobjects != slabspares[class]->objectcount) {
+        slabspares[class] = slab;
+    } else {
+        slabUnlink(slab, class);
+        slabcounts[class]--;
+        slabfreebytes -= (size_t) slab->objectcount * slab->objectsize;
+        pagemapSet(slab, slab->length, NULL);
+        unmapAligned(slab, slab->length);
+    }
+}
+
+/**
+ * Returns an object to its slab chunk. Caller must hold heaplock.
+ * @param[in] slab chunk
+ * @param[in] object handed out by slabAlloc()
+ */
+static void slabFree (Chunk *slab, void *ptr) {
+    size_t object = ((char*) ptr - slab->objects) / slab->objectsize;
+
+    slabFreeRun(slab, object / 64, 1ULL << (object % 64));
+}
+
+/**
+ * Checks whether an object of a slab chunk is currently handed out. Safe to call without heaplock.
+ * @param[in] slab chunk
+ * @param[in] object pointer, already known to lie on an object boundary
+ * @param[out] 1 if handed out, 0 if free
+ */
+static int slabInUse (Chunk *slab, void *ptr) {
+    size_t object = ((char*) ptr - slab->objects) / slab->objectsize;
+
+    return (__atomic_load_n(&slab->occupancy[object / 64], __ATOMIC_RELAXED) >> (object % 64)) & 1;
+}
+
+/**
+ * Hands out user data of the given size from a slab or from the heap chunks. Caller must hold heaplock.
+ * @param[in] user requested size (already rounded up, below MMAP_THRESHOLD)
+ * @param[out] pointer to the user data, or NULL if the system is out of memory
+ */
+static void* blockAlloc (size_t size) {
+    MetaData *curr = NULL;
+
+    if (size <= SLAB_MAX_SIZE) {
+        return slabAlloc(size);
+    }
+
+    curr = heapAlloc((unsigned int) size);
+    return (curr != NULL) ? (void*) (curr + 1) : NULL;
+}
+
+/**
+ * Takes back user data handed out by blockAlloc(). Caller must hold heaplock.
+ * @param[in] pointer to the user data
+ */
+static void blockFree (void *ptr) {
+    Chunk *chunk = chunkOf(ptr);
+
+    if (chunk->kind == 'S') {
+        slabFree(chunk, ptr);
+    } else {
+        heapFree(((MetaData*) ptr) - 1);
+    }
+}
+
+/**
+ * TCache is a small per-thread stack of recently freed user data for every small size. Cached blocks stay
+ * marked used in their heap chunk or slab and are chained through their first bytes, so a thread can reuse
+ * them without taking heaplock. Only refills and flushes go back to the shared bins and slabs.
+ */
+typedef struct TCache {
+    void *entries[NUM_SMALL_BINS]; // head of the cached user data for each small size, see TCACHE_INDEX
+    unsigned char counts[NUM_SMALL_BINS]; // number of cached blocks for each small size
+    char registered; // whether the thread exit destructor has been set up
+    char shutdown; // set by the thread exit destructor, after which the thread's blocks bypass the cache
+} TCache;
+
+#define TCACHE_NEXT(ptr) (*(void**) (ptr)) // cached user data holds the pointer to the next one
+#define TCACHE_INDEX(size) (ALIGN_UP(size, SIZE_GRANULE) / SIZE_GRANULE - 1) // slab classes and small heap block sizes never share an index
+
+static __thread TCache tcache;
+
+/**
+ * Block size of every request small enough for a thread cache, by (size - 1) / 8: slab classes and heap block
+ * sizes both change only at multiples of 8 bytes, so one entry covers 8 request sizes. mymalloc() serves cache
+ * hits straight from this without any of the checks and rounding allocate() does.
+ */
+#define FAST_MAX_SIZE (SMALL_BIN_LIMIT - METADATA_SIZE) // largest request whose block is below SMALL_BIN_LIMIT
+#define FAST_SIZE(i) (((i) + 1) * 8 <= SLAB_MIN_SIZE ? SLAB_MIN_SIZE : ((i) + 1) * 8 <= 2 * SLAB_MIN_SIZE ? 2 * SLAB_MIN_SIZE : \
+                      ((i) + 1) * 8 <= SLAB_MAX_SIZE ? SLAB_MAX_SIZE : BLOCK_SIZE(((i) + 1) * 8))
+
+static const unsigned char fastsizes[FAST_MAX_SIZE / 8] = {
+    FAST_SIZE(0), FAST_SIZE(1), FAST_SIZE(2), FAST_SIZE(3), FAST_SIZE(4), FAST_SIZE(5), FAST_SIZE(6), FAST_SIZE(7),
+    FAST_SIZE(8), FAST_SIZE(9), FAST_SIZE(10), FAST_SIZE(11), FAST_SIZE(12), FAST_SIZE(13), FAST_SIZE(14), FAST_SIZE(15),
+    FAST_SIZE(16), FAST_SIZE(17), FAST_SIZE(18), FAST_SIZE(19), FAST_SIZE(20), FAST_SIZE(21), FAST_SIZE(22), FAST_SIZE(23),
+    FAST_SIZE(24), FAST_SIZE(25), FAST_SIZE(26), FAST_SIZE(27), FAST_SIZE(28), FAST_SIZE(29), FAST_SIZE(30),
+};
+
+/**
+ * Class mymalloc_stats() counts the blocks of each thread cache index in (see statsClass()), so counting a cache
+ * hit takes no bit scan either. The class boundaries are multiples of SIZE_GRANULE, like those of the indexes.
+ */
+#define FAST_CLASS(i) (((i) + 1) * SIZE_GRANULE <= 16 ? 0 : ((i) + 1) * SIZE_GRANULE <= 32 ? 1 : ((i) + 1) * SIZE_GRANULE <= 64 ? 2 : \
+                       ((i) + 1) * SIZE_GRANULE <= 128 ? 3 : 4)
+
+static const unsigned char fastclasses[NUM_SMALL_BINS] = {
+    FAST_CLASS(0), FAST_CLASS(1), FAST_CLASS(2), FAST_CLASS(3), FAST_CLASS(4), FAST_CLASS(5), FAST_CLASS(6), FAST_CLASS(7),
+    FAST_CLASS(8), FAST_CLASS(9), FAST_CLASS(10), FAST_CLASS(11), FAST_CLASS(12), FAST_CLASS(13), FAST_CLASS(14), FAST_CLASS(15),
+};
+static pthread_key_t tcachekey; // used only to flush a thread's cache when it exits
+static pthread_once_t tcacheonce = PTHREAD_ONCE_INIT;
+
+/**
+ * Gives every block cached for one small size back to the shared bins and slabs. Caller must hold heaplock.
+ * @param[in] thread cache
+ * @param[in] small bin index
+ */
+static void tcacheFlush (TCache *cache, unsigned int index) {
+    void *curr = NULL;
+
+    while (cache->entries[index] != NULL) {
+        curr = cache->entries[index];
+        cache->entries[index] = TCACHE_NEXT(curr);
+        blockFree(curr);
+    }
+    cache->counts[index] = 0;
+}
+
+/**
+ * Gives every block held by a thread cache back to the shared bins and slabs. Caller must hold heaplock.
+ * @param[in] thread cache
+ * @param[out] 1 if any block was returned, 0 if the cache was empty
+ */
+static int tcacheFlushAll (TCache *cache) {
+    int flushed = 0;
+
+    for (unsigned int i = 0; i < NUM_SMALL_BINS; i++) {
+        if (cache->counts[i] != 0) {
+            tcacheFlush(cache, i);
+            flushed = 1;
+        }
+    }
+
+    return flushed;
+}
+
+/**
+ * Thread exit destructor so that blocks cached by a finished thread are not lost. Destructors of other keys
+ * may still run on the thread afterwards and free or allocate, so the cache is also shut down for good.
+ * @param[in] thread cache of the exiting thread
+ */
+static void tcacheDestroy (void *cache) {
+    pthread_mutex_lock(&heaplock);
+    tcacheFlushAll((TCache*) cache);
+    ((TCache*) cache)->shutdown = 1;
+    pthread_mutex_unlock(&heaplock);
+}
+
+static void tcacheCreateKey () {
+    pthread_key_create(&tcachekey, tcacheDestroy);
+}
+
+/**
+ * Tops up this thread's cache for one small size with blocks of that size. Caller must hold heaplock.
+ * @param[in] small bin index
+ * @param[in] user data block size of that bin
+ */
+static void tcacheRefill (unsigned int index, size_t size) {
+    void *curr = NULL;
+
+    if (!tcache.registered) {
+        pthread_once(&tcacheonce, tcacheCreateKey);
+        pthread_setspecific(tcachekey, &tcache);
+        tcache.registered = 1;
+    }
+
+    while (tcache.counts[index] < TCACHE_REFILL && (curr = blockAlloc(size)) != NULL) {
+        if (size > SLAB_MAX_SIZE && blockLength(((MetaData*) curr) - 1) != size) { // cached blocks must be exactly their size
+            blockFree(curr);
+            break;
+        }
+        TCACHE_NEXT(curr) = tcache.entries[index];
+        tcache.entries[index] = curr;
+        tcache.counts[index]++;
+    }
+}
+
+/**
+ * Statistics for mymalloc_stats(). Every thread counts its own calls in threadstats, so keeping them up to date
+ * costs a few plain additions on the fast path. The bytes a thread hands out and takes back are added to the
+ * shared statsinuse in steps of about STATS_PUBLISH_BYTES. In between, the thread keeps the highest its
+ * unpublished bytes got, and publishing raises statspeak by that high-water mark, so the peak catches every
+ * spike without the fast path touching shared memory. Threads are linked in statsthreads so their counters can
+ * be summed, and fold them into statsretired when they exit. The heap side (free blocks, footprint) is kept by
+ * the bins and slabs themselves.
+ */
+#define STATS_PUBLISH_BYTES 4096
+
+typedef struct ThreadStats {
+    long long inuse; // bytes handed out minus bytes taken back, not yet added to statsinuse
+    long long highwater; // highest inuse since it was last added to statsinuse
+    unsigned long long allocs[STATS_CLASSES];
+    unsigned long long frees[STATS_CLASSES];
+    unsigned long long failures[STATS_CLASSES];
+    struct ThreadStats *nextstats;
+    struct ThreadStats *prevstats;
+    char registered; // whether it is linked in statsthreads
+    char retired; // set when the thread exits, after which its calls are counted in statsretired right away
+} ThreadStats;
+
+static __thread ThreadStats threadstats;
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER; // guards statsthreads and statsretired
+static ThreadStats *statsthreads = NULL; // every thread that has made a call and not exited yet
+static ThreadStats statsretired; // counters of threads that have exited
+static long long statsinuse = 0; // bytes handed out, as published by the threads
+static long long statspeak = 0; // highest statsinuse seen
+static pthread_key_t statskey; // used only to retire a thread's counters when it exits
+static pthread_once_t statsonce = PTHREAD_ONCE_INIT;
+
+/**
+ * Maps a size to the class mymalloc_stats() counts it in: up to 16 bytes, up to 32, and so on.
+ * @param[in] size
+ * @param[out] class in [0, STATS_CLASSES)
+ */
+static unsigned int statsClass (size_t size) {
+    unsigned int class = (size <= 16) ? 0 : 64 - __builtin_clzll(size - 1) - 4;
+
+    return (class < STATS_CLASSES) ? class : STATS_CLASSES - 1;
+}
+
+/**
+ * Counters of a thread are only ever written by that thread but summed by others, so they are updated with
+ * relaxed atomic stores, which compile to plain additions.
+ */
+static void statsIncrement (unsigned long long *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Raises statspeak to the given use if it is higher.
+ * @param[in] bytes in use
+ */
+static void statsRaisePeak (long long inuse) {
+    long long peak = __atomic_load_n(&statspeak, __ATOMIC_RELAXED);
+
+    while (inuse > peak && !__atomic_compare_exchange_n(&statspeak, &peak, inuse, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Adds a thread's unpublished bytes to statsinuse, and raises statspeak by their high-water mark.
+ * @param[in] thread counters
+ */
+static void statsPublish (ThreadStats *stats) {
+    long long published = __atomic_fetch_add(&statsinuse, __atomic_exchange_n(&stats->inuse, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+    statsRaisePeak(published + __atomic_exchange_n(&stats->highwater, 0, __ATOMIC_RELAXED));
+}
+
+/**
+ * Moves a thread's counters into statsretired and its bytes into statsinuse, leaving them all zero. Caller must
+ * hold statslock.
+ * @param[in] thread counters
+ */
+static void statsFold (ThreadStats *stats) {
+    statsPublish(stats);
+    for (unsigned int i = 0; i < STATS_CLASSES; i++) {
+        statsretired.allocs[i] += stats->allocs[i];
+        statsretired.frees[i] += stats->frees[i];
+        statsretired.failures[i] += stats->failures[i];
+        __atomic_store_n(&stats->allocs[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->frees[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->failures[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Thread exit destructor folding a thread's counters into statsretired. Destructors of other keys may still
+ * run on the thread afterwards and allocate or free, so the counters are marked retired rather than left
+ * registered: see statsSync().
+ * @param[in] counters of the exiting thread
+ */
+static void statsRetire (void *arg) {
+    ThreadStats *stats = (ThreadStats*) arg;
+
+    pthread_mutex_lock(&statslock);
+    statsFold(stats);
+    if (stats->prevstats != NULL) {
+        stats->prevstats->nextstats = stats->nextstats;
+    } else {
+        statsthreads = stats->nextstats;
+    }
+    if (stats->nextstats != NULL) {
+        stats->nextstats->prevstats = stats->prevstats;
+    }
+    stats->registered = 0;
+    stats->retired = 1;
+    pthread_mutex_unlock(&statslock);
+}
+
+static void statsCreateKey () {
+    pthread_key_create(&statskey, statsRetire);
+}
+
+/**
+ * Links the calling thread's counters into statsthreads, the first time it makes a call.
+ */
+static void statsRegister () {
+    pthread_once(&statsonce, statsCreateKey);
+    pthread_setspecific(statskey, &threadstats);
+
+    pthread_mutex_lock(&statslock);
+    threadstats.prevstats = NULL;
+    threadstats.nextstats = statsthreads;
+    if (statsthreads != NULL) {
+        statsthreads->prevstats = &threadstats;
+    }
+    statsthreads = &threadstats;
+    threadstats.registered = 1;
+    pthread_mutex_unlock(&statslock);
+}
+
+/**
+ * Slow side of the counting: registers the calling thread the first time it makes a call and publishes its
+ * bytes. A thread whose counters have been retired is exiting and will not publish again, so whatever it
+ * counted is folded into statsretired at once.
+ */
+static void statsSync () __attribute__((cold, noinline));
+
+static void statsSync () {
+    if (threadstats.retired) {
+        pthread_mutex_lock(&statslock);
+        statsFold(&threadstats);
+        pthread_mutex_unlock(&statslock);
+        return;
+    } else if (!threadstats.registered) {
+        statsRegister();
+    }
+    statsPublish(&threadstats);
+}
+
+/**
+ * Tells whether the calling thread can count the given bytes without statsSync(). The mymalloc() fast path
+ * only serves requests that can, so it never makes a call.
+ * @param[in] bytes handed out, negative when taken back
+ * @param[out] 1 if the thread is registered and the bytes stay short of STATS_PUBLISH_BYTES, 0 otherwise
+ */
+static inline __attribute__((always_inline)) int statsFits (long long bytes) {
+    return threadstats.registered && threadstats.inuse + bytes < STATS_PUBLISH_BYTES && threadstats.inuse + bytes > -STATS_PUBLISH_BYTES;
+}
+
+/**
+ * Changes the bytes the calling thread has in use and their high-water mark, without publishing them.
+ * @param[in] bytes handed out, negative when taken back
+ */
+static inline __attribute__((always_inline)) void statsAdd (long long bytes) {
+    long long inuse = threadstats.inuse + bytes;
+
+    __atomic_store_n(&threadstats.inuse, inuse, __ATOMIC_RELAXED);
+    if (inuse > threadstats.highwater) {
+        __atomic_store_n(&threadstats.highwater, inuse, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Changes the bytes the calling thread has in use and their high-water mark, publishing them once they add up
+ * to STATS_PUBLISH_BYTES. Always inlined, since it is part of the fast paths.
+ * @param[in] bytes handed out, negative when taken back
+ */
+static inline __attribute__((always_inline)) void statsAdjust (long long bytes) {
+    statsAdd(bytes);
+    if (__builtin_expect(!threadstats.registered || threadstats.inuse >= STATS_PUBLISH_BYTES || threadstats.inuse <= -STATS_PUBLISH_BYTES, 0)) {
+        statsSync();
+    }
+}
+
+/**
+ * Counts a user data block handed out, or taken back (negative size), by the calling thread. Always inlined,
+ * since it is part of the fast paths.
+ * @param[in] user data block size, negative when it is freed
+ */
+static inline __attribute__((always_inline)) void statsUpdate (long long size) {
+    if (size > 0) {
+        statsIncrement(&threadstats.allocs[statsClass((size_t) size)]);
+    } else if (size < 0) {
+        statsIncrement(&threadstats.frees[statsClass((size_t) -size)]);
+    }
+    statsAdjust(size);
+}
+
+/**
+ * Counts a user data block resized in place by the calling thread, which is neither a new block nor a freed one.
+ * @param[in] user data block size before
+ * @param[in] user data block size after
+ */
+static void statsResize (size_t oldsize, size_t newsize) {
+    statsAdjust((long long) newsize - (long long) oldsize);
+}
+
+/**
+ * Counts a request the calling thread made that could not be served.
+ * @param[in] requested size
+ */
+static void statsFailure (size_t size) {
+    statsIncrement(&threadstats.failures[statsClass(size)]);
+    if (!threadstats.registered) {
+        statsSync();
+    }
+}
+
+/**
+ * Reports the state of the allocator from counters kept up to date by every call, so it is cheap enough to
+ * sample from a monitoring thread while the program runs: only the largest free block takes a look at the
+ * blocks of one bin. Safe to call from several threads at once.
+ * @param[out] statistics
+ */
+MallocStats mymalloc_stats () {
+    MallocStats stats;
+    ThreadStats *thread = NULL;
+    long long inuse = 0;
+    long long unpublished = 0; // bytes of one thread not added to statsinuse yet
+    long long highwater = 0; // highest those bytes got since it last published
+    long long spike = 0; // most any thread's unpublished bytes were above where they are now
+    unsigned int top = 0; // highest non-empty bin
+
+    memset(&stats, 0, sizeof(stats));
+
+    pthread_mutex_lock(&statslock);
+    inuse = __atomic_load_n(&statsinuse, __ATOMIC_RELAXED);
+    for (unsigned int i = 0; i < STATS_CLASSES; i++) {
+        stats.allocs[i] = statsretired.allocs[i];
+        stats.frees[i] = statsretired.frees[i];
+        stats.failures[i] = statsretired.failures[i];
+    }
+    for (thread = statsthreads; thread != NULL; thread = thread->nextstats) {
+        unpublished = __atomic_load_n(&thread->inuse, __ATOMIC_RELAXED);
+        highwater = __atomic_load_n(&thread->highwater, __ATOMIC_RELAXED);
+        inuse += unpublished;
+        spike = (highwater - unpublished > spike) ? highwater - unpublished : spike;
+        for (unsigned int i = 0; i < STATS_CLASSES; i++) {
+            stats.allocs[i] += __atomic_load_n(&thread->allocs[i], __ATOMIC_RELAXED);
+            stats.frees[i] += __atomic_load_n(&thread->frees[i], __ATOMIC_RELAXED);
+            stats.failures[i] += __atomic_load_n(&thread->failures[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&statslock);
+
+    for (unsigned int i = 0; i < STATS_CLASSES; i++) {
+        stats.usedblocks += stats.allocs[i] - stats.frees[i];
+    }
+    stats.inuse = (inuse > 0) ? (size_t) inuse : 0;
+    statsRaisePeak(inuse + spike); // bytes not published yet can make the current use, or a recent spike, the peak
+    stats.peakinuse = (size_t) __atomic_load_n(&statspeak, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&heaplock);
+    stats.freebytes = binbytes + slabfreebytes;
+    stats.freeblocks = bincount;
+    if (binmap != 0) {
+        top = 63 - __builtin_clzll(binmap);
+        for (MetaData *curr = bins[top]; curr != NULL; curr = LINKS(curr)->nextfree) {
+            if (blockLength(curr) > stats.largestfree) {
+                stats.largestfree = blockLength(curr);
+            }
+        }
+    }
+    if (binbytes > 0) {
+        stats.fragmentation = 1.0 - (double) stats.largestfree / binbytes;
+    }
+    pthread_mutex_unlock(&heaplock);
+    stats.footprint = mymalloc_footprint();
+
+    return stats;
+}
+
+/**
+ * Tracing and profiling both look at every successful call. observers has a bit set for each of them that
+ * is switched on, so when neither is the calls only pay for reading it.
+ */
+#define OBSERVE_TRACE 1
+#define OBSERVE_PROFILE 2
+
+static int observers = 0; // OBSERVE_ bits, read without any lock on every call
+
+/**
+ * Tracing records every successful mymalloc(), myaligned_alloc(), myfree() and myrealloc() call, with the file
+ * and line it came from, into a binary trace file (see TraceRecord) that memgrind can replay. Records are
+ * gathered in tracebuffer and written with write() rather than stdio, which could itself allocate. A call is
+ * recorded before the block it frees can be handed out again, so the records of all threads are in an order
+ * that can be replayed one after the other.
+ */
+#define TRACE_BUFFER_SIZE 65536
+
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER; // guards everything below
+static int tracefd = -1;
+static char tracebuffer[TRACE_BUFFER_SIZE];
+static size_t tracebuffered = 0; // bytes in tracebuffer not yet written
+static const char *tracefiles[TRACE_MAX_FILES]; // file names given an id so far, the id is the index
+static int traceexit = 0; // whether the trace is flushed when the program exits
+
+/**
+ * Writes out everything in tracebuffer. Caller must hold tracelock.
+ */
+static void traceFlush () {
+    size_t written = 0;
+    ssize_t result = 0;
+
+    while (written < tracebuffered) {
+        result = write(tracefd, tracebuffer + written, tracebuffered - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result <= 0) {
+            break; // nothing sensible left to do with the rest, the trace ends early
+        }
+        written += (size_t) result;
+    }
+    tracebuffered = 0;
+}
+
+/**
+ * Appends bytes to the trace. Caller must hold tracelock.
+ * @param[in] bytes to append
+ * @param[in] number of bytes
+ */
+static void traceAppend (const void *data, size_t length) {
+    size_t part = 0;
+
+    while (length > 0) {
+        if (tracebuffered == TRACE_BUFFER_SIZE) {
+            traceFlush();
+        }
+        part = (length < TRACE_BUFFER_SIZE - tracebuffered) ? length : TRACE_BUFFER_SIZE - tracebuffered;
+        memcpy(tracebuffer + tracebuffered, data, part);
+        tracebuffered += part;
+        data = (const char*) data + part;
+        length -= part;
+    }
+}
+
+/**
+ * Finds the id of a source file, giving it one and writing its name to the trace the first time it shows up.
+ * __FILE__ of one file is the same string every time, so files are told apart by the address of their name.
+ * Caller must hold tracelock.
+ * @param[in] file name passed in by the macros
+ * @param[out] id of the file, or TRACE_UNKNOWN_FILE once TRACE_MAX_FILES files have an id
+ */
+static uint16_t traceFileId (const char *file) {
+    unsigned int index = (unsigned int) (((uintptr_t) file >> 3) % TRACE_MAX_FILES);
+    TraceRecord record;
+
+    for (unsigned int i = 0; i < TRACE_MAX_FILES; i++, index = (index + 1) % TRACE_MAX_FILES) {
+        if (tracefiles[index] == file) {
+            return (uint16_t) index;
+        } else if (tracefiles[index] == NULL) {
+            tracefiles[index] = file;
+            memset(&record, 0, sizeof(record));
+            record.op = TRACE_FILE;
+            record.file = (uint16_t) index;
+            record.size = strlen(file);
+            traceAppend(&record, sizeof(record));
+            traceAppend(file, record.size);
+            return (uint16_t) index;
+        }
+    }
+
+    return TRACE_UNKNOWN_FILE;
+}
+
+/**
+ * Adds one call to the trace, if one is being recorded.
+ * @param[in] TRACE_MALLOC, TRACE_ALIGNED_ALLOC, TRACE_FREE or TRACE_REALLOC
+ * @param[in] file wherein user made the call
+ * @param[in] line number from file wherein user made the call
+ * @param[in] user data block handed out, freed or resized to
+ * @param[in] requested size
+ * @param[in] alignment for TRACE_ALIGNED_ALLOC, block before resizing for TRACE_REALLOC
+ */
+static void traceRecord (uint8_t op, char *file, int line, void *ptr, size_t size, uint64_t extra) {
+    TraceRecord record;
+
+    pthread_mutex_lock(&tracelock);
+    if (tracefd >= 0) {
+        memset(&record, 0, sizeof(record));
+        record.op = op;
+        record.file = traceFileId(file);
+        record.line = (uint32_t) line;
+        record.ptr = (uint64_t) (uintptr_t) ptr;
+        record.size = size;
+        record.extra = extra;
+        traceAppend(&record, sizeof(record));
+    }
+    pthread_mutex_unlock(&tracelock);
+}
+
+/**
+ * Starts recording every allocator call into a new trace file, replacing any trace being recorded. A program can
+ * also be traced without changes by setting the MYMALLOC_TRACE environment variable to the trace file path.
+ * The trace is completed by mymalloc_trace_stop(), or when the program exits. The file stays locked while it is
+ * recorded, so a program the traced one runs, which inherits MYMALLOC_TRACE, does not wipe it by starting over.
+ * @param[in] path of the trace file, created or truncated
+ * @param[out] 1 if recording started, 0 if the file could not be opened or another process is recording into it
+ */
+int mymalloc_trace_start (const char *path) {
+    TraceHeader header;
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        return 0;
+    }
+    // only truncated once it is ours, a failed attempt leaves the other process' trace alone
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, 0) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    mymalloc_trace_stop();
+    pthread_mutex_lock(&tracelock);
+    tracefd = fd;
+    memset(tracefiles, 0, sizeof(tracefiles));
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.recordsize = sizeof(TraceRecord);
+    traceAppend(&header, sizeof(header));
+    if (!traceexit) {
+        traceexit = 1;
+        atexit(mymalloc_trace_stop);
+    }
+    __atomic_fetch_or(&observers, OBSERVE_TRACE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tracelock);
+    return 1;
+}
+
+/**
+ * Stops recording, writing out and closing the trace file. Does nothing if no trace is being recorded.
+ */
+void mymalloc_trace_stop () {
+    pthread_mutex_lock(&tracelock);
+    if (tracefd >= 0) {
+        __atomic_fetch_and(&observers, ~OBSERVE_TRACE, __ATOMIC_RELAXED);
+        traceFlush();
+        close(tracefd);
+        tracefd = -1;
+    }
+    pthread_mutex_unlock(&tracelock);
+}
+
+/**
+ * Profiling keeps, for every call site (the file and line the macros pass in), how many blocks it allocated,
+ * how many bytes, how many of them are still live, and a histogram of how long its blocks lived before they
+ * were freed. Live blocks are found again on free through a side table from pointer to call site, so blocks
+ * carry nothing extra. Both tables live in memory mapped directly, and the report is formatted with snprintf()
+ * and written with write(), so the profiler never calls back into the allocator. myrealloc() counts as freeing
+ * the old block and allocating the new one at the realloc() call site.
+ */
+typedef struct ProfileSite {
+    const char *file; // NULL while the entry is unused
+    int line;
+    unsigned long long allocs;
+    unsigned long long frees;
+    unsigned long long bytes; // requested bytes over all allocations
+    unsigned long long livebytes; // requested bytes of blocks not freed yet
+    unsigned long long peaklivebytes;
+    unsigned long long lifetimes[PROFILE_LIFETIME_BUCKETS];
+} ProfileSite;
+
+typedef struct ProfileBlock {
+    uintptr_t ptr; // 0 while the entry is unused, 1 once it has been removed
+    unsigned int site; // index in profilesites
+    unsigned int unused;
+    size_t size; // requested size
+    long long allocated; // when it was allocated, in nanoseconds
+} ProfileBlock;
+
+static pthread_mutex_t profilelock = PTHREAD_MUTEX_INITIALIZER; // guards everything below
+static ProfileSite *profilesites = NULL; // PROFILE_MAX_SITES entries, open addressing on file and line
+static unsigned int profilesitecount = 0;
+static ProfileBlock *profileblocks = NULL; // live blocks, open addressing on the pointer
+static size_t profilecapacity = 0; // entries in profileblocks, a power of two
+static size_t profileused = 0; // entries of profileblocks in use or removed
+static size_t profilelive = 0; // entries of profileblocks in use
+static int profiletop = 0; // call sites listed by the report at exit, 0 if there is no report at exit
+
+static long long profileNow () {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Finds the entry of a call site, claiming one the first time the site shows up. Caller must hold profilelock.
+ * @param[in] file passed in by the macros
+ * @param[in] line passed in by the macros
+ * @param[out] index in profilesites
+ */
+static unsigned int profileSite (const char *file, int line) {
+    unsigned int index = (unsigned int) ((((uintptr_t) file >> 3) ^ ((uintptr_t) line * 0x9E3779B1u)) % (PROFILE_MAX_SITES - 1));
+
+    // the last entry is kept for sites that find the table full
+    while (profilesites[index].file != NULL && (profilesites[index].file != file || profilesites[index].line != line)) {
+        index = (index + 1) % (PROFILE_MAX_SITES - 1);
+    }
+    if (profilesites[index].file == NULL) {
+        if (profilesitecount == PROFILE_MAX_SITES - 2) { // keep one empty entry so the search above always ends
+            return PROFILE_MAX_SITES - 1;
+        }
+        profilesites[index].file = file;
+        profilesites[index].line = line;
+        profilesitecount++;
+    }
+
+    return index;
+}
+
+/**
+ * Finds where a pointer is, or would go, in profileblocks. Caller must hold profilelock.
+ * @param[in] pointer
+ * @param[out] index of its entry, or else of the first removed or empty entry of its probe sequence
+ */
+static size_t profileProbe (ProfileBlock *blocks, size_t capacity, uintptr_t ptr) {
+    size_t index = (size_t) (((ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 20) & (capacity - 1);
+    size_t removed = capacity; // first removed entry seen, reused so that freed addresses coming back do not lengthen the sequence
+
+    while (blocks[index].ptr != 0 && blocks[index].ptr != ptr) {
+        if (blocks[index].ptr == 1 && removed == capacity) {
+            removed = index;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return (blocks[index].ptr == 0 && removed != capacity) ? removed : index;
+}
+
+/**
+ * Rebuilds profileblocks once it is half full, dropping removed entries. It only doubles if more than a
+ * quarter of it is in use, so a program that keeps allocating and freeing does not grow it.
+ * Caller must hold profilelock.
+ * @param[out] 1 if there is room for another block, 0 if the system is out of memory
+ */
+static int profileGrow () {
+    size_t capacity = profilecapacity;
+    ProfileBlock *blocks = NULL;
+    size_t used = 0;
+
+    if ((profileused + 1) * 2 <= profilecapacity) {
+        return 1;
+    }
+    if (capacity == 0) {
+        capacity = 65536;
+    } else if ((profilelive + 1) * 4 > capacity) {
+        capacity *= 2;
+    }
+
+    blocks = mmap(NULL, capacity * sizeof(ProfileBlock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (blocks == MAP_FAILED) {
+        return 0;
+    }
+    for (size_t i = 0; i < profilecapacity; i++) {
+        if (profileblocks[i].ptr > 1) {
+            blocks[profileProbe(blocks, capacity, profileblocks[i].ptr)] = profileblocks[i];
+            used++;
+        }
+    }
+    if (profileblocks != NULL) {
+        munmap(profileblocks, profilecapacity * sizeof(ProfileBlock));
+    }
+    profileblocks = blocks;
+    profilecapacity = capacity;
+    profileused = used;
+    return 1;
+}
+
+/**
+ * Counts a block handed out at a call site. Caller must hold profilelock.
+ */
+static void profileAlloc (char *file, int line, void *ptr, size_t size) {
+    ProfileSite *site = NULL;
+    size_t index = 0;
+
+    if (!profileGrow()) {
+        return;
+    }
+
+    index = profileProbe(profileblocks, profilecapacity, (uintptr_t) ptr);
+    if (profileblocks[index].ptr == 0) {
+        profileused++;
+    }
+    if (profileblocks[index].ptr != (uintptr_t) ptr) {
+        profilelive++;
+    }
+    profileblocks[index].ptr = (uintptr_t) ptr;
+    profileblocks[index].site = profileSite(file, line);
+    profileblocks[index].size = size;
+    profileblocks[index].allocated = profileNow();
+
+    site = &profilesites[profileblocks[index].site];
+    site->allocs++;
+    site->bytes += size;
+    site->livebytes += size;
+    if (site->livebytes > site->peaklivebytes) {
+        site->peaklivebytes = site->livebytes;
+    }
+}
+
+/**
+ * Counts a block taken back, against the call site that allocated it. Blocks allocated before profiling
+ * started are not known and are ignored. Caller must hold profilelock.
+ */
+static void profileFree (void *ptr) {
+    ProfileBlock *block = NULL;
+    ProfileSite *site = NULL;
+    long long lifetime = 0;
+    unsigned int bucket = 0;
+
+    if (profilecapacity == 0) {
+        return;
+    }
+    block = &profileblocks[profileProbe(profileblocks, profilecapacity, (uintptr_t) ptr)];
+    if (block->ptr != (uintptr_t) ptr) {
+        return;
+    }
+
+    site = &profilesites[block->site];
+    site->frees++;
+    site->livebytes -= block->size;
+    for (lifetime = (profileNow() - block->allocated) / 1000; lifetime > 0 && bucket < PROFILE_LIFETIME_BUCKETS - 1; lifetime /= 10) {
+        bucket++;
+    }
+    site->lifetimes[bucket]++;
+    block->ptr = 1; // removed, but still part of probe sequences
+    profilelive--;
+}
+
+/**
+ * Adds one call to the profile. Takes profilelock.
+ * @param[in] TRACE_MALLOC, TRACE_ALIGNED_ALLOC, TRACE_FREE or TRACE_REALLOC
+ * @param[in] file wherein user made the call
+ * @param[in] line number from file wherein user made the call
+ * @param[in] user data block handed out, freed or resized to
+ * @param[in] requested size
+ * @param[in] TRACE_REALLOC: block before resizing
+ */
+static void profileRecord (uint8_t op, char *file, int line, void *ptr, size_t size, uint64_t extra) {
+    pthread_mutex_lock(&profilelock);
+    if (profilesites != NULL) {
+        if (op == TRACE_FREE) {
+            profileFree(ptr);
+        } else {
+            if (op == TRACE_REALLOC) {
+                profileFree((void*) (uintptr_t) extra);
+            }
+            profileAlloc(file, line, ptr, size);
+        }
+    }
+    pthread_mutex_unlock(&profilelock);
+}
+
+/**
+ * Starts profiling call sites, clearing any earlier profile. A program can also be profiled without changes by
+ * setting the MYMALLOC_PROFILE environment variable to the number of call sites to report at exit.
+ * @param[in] number of call sites the report written to stderr at exit lists, 0 for no report at exit
+ * @param[out] 1 if profiling started, 0 if the system is out of memory
+ */
+int mymalloc_profile_start (int top) {
+    ProfileSite *sites = NULL;
+
+    pthread_mutex_lock(&profilelock);
+    if (profilesites == NULL) {
+        sites = mmap(NULL, PROFILE_MAX_SITES * sizeof(ProfileSite), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sites == MAP_FAILED) {
+            pthread_mutex_unlock(&profilelock);
+            return 0;
+        }
+        profilesites = sites;
+        profilesites[PROFILE_MAX_SITES - 1].file = "(other sites)";
+    } else {
+        memset(profilesites, 0, (PROFILE_MAX_SITES - 1) * sizeof(ProfileSite));
+        memset(&profilesites[PROFILE_MAX_SITES - 1].allocs, 0, sizeof(ProfileSite) - offsetof(ProfileSite, allocs));
+        memset(profileblocks, 0, profilecapacity * sizeof(ProfileBlock));
+    }
+    profilesitecount = 0;
+    profileused = 0;
+    profilelive = 0;
+    if (top > 0 && profiletop == 0) {
+        atexit(mymalloc_profile_stop);
+    }
+    profiletop = top;
+    __atomic_fetch_or(&observers, OBSERVE_PROFILE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profilelock);
+    return 1;
+}
+
+/**
+ * Writes all of a report line, write() may take only part of it.
+ */
+static void profileWrite (int fd, const char *line, int length) {
+    ssize_t result = 0;
+
+    for (int written = 0; written < length; written += (int) result) {
+        result = write(fd, line + written, (size_t) (length - written));
+        if (result < 0 && errno == EINTR) {
+            result = 0;
+        } else if (result <= 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * Writes the call sites that allocated the most bytes, along with their counts, live bytes and the lifetimes
+ * of their freed blocks. Does nothing if profiling was never started.
+ * @param[in] file descriptor to write to, e.g. STDERR_FILENO
+ * @param[in] number of call sites to list, at most PROFILE_MAX_TOP
+ */
+void mymalloc_profile_report (int fd, int top) {
+    unsigned int order[PROFILE_MAX_TOP]; // sites listed so far, most bytes first
+    unsigned int count = 0;
+    unsigned int at = 0;
+    ProfileSite *site = NULL;
+    char line[512];
+    int length = 0;
+
+    top = (top > PROFILE_MAX_TOP) ? PROFILE_MAX_TOP : top;
+    pthread_mutex_lock(&profilelock);
+    if (profilesites == NULL || top <= 0) {
+        pthread_mutex_unlock(&profilelock);
+        return;
+    }
+
+    // insertion into the short list of the top sites
+    for (unsigned int i = 0; i < PROFILE_MAX_SITES; i++) {
+        if (profilesites[i].allocs == 0) {
+            continue;
+        }
+        for (at = count; at > 0 && profilesites[order[at - 1]].bytes < profilesites[i].bytes; at--) {
+            if (at < (unsigned int) top) {
+                order[at] = order[at - 1];
+            }
+        }
+        if (at < (unsigned int) top) {
+            order[at] = i;
+            count += (count < (unsigned int) top);
+        }
+    }
+
+    length = snprintf(line, sizeof(line), "mymalloc profile: %u call sites, top %u by bytes allocated\n"
+                      "%10s %10s %14s %14s %14s  %-32s lifetimes: <1us <10us <100us <1ms <10ms <100ms <1s >=1s\n",
+                      profilesitecount, count, "allocs", "frees", "bytes", "live bytes", "peak live", "call site");
+    profileWrite(fd, line, length);
+    for (unsigned int i = 0; i < count; i++) {
+        site = &profilesites[order[i]];
+        length = snprintf(line, sizeof(line), "%10llu %10llu %14llu %14llu %14llu  %-26.26s:%-5d", site->allocs, site->frees,
+                          site->bytes, site->livebytes, site->peaklivebytes, site->file, site->line);
+        for (unsigned int j = 0; j < PROFILE_LIFETIME_BUCKETS; j++) {
+            length += snprintf(line + length, sizeof(line) - length, " %llu", site->lifetimes[j]);
+        }
+        length += snprintf(line + length, sizeof(line) - length, "\n");
+        profileWrite(fd, line, length);
+    }
+    pthread_mutex_unlock(&profilelock);
+}
+
+/**
+ * Stops profiling, writing the report to stderr if one was asked for at exit. The profile is kept, so
+ * mymalloc_profile_report() can still be called.
+ */
+void mymalloc_profile_stop () {
+    int top = 0;
+
+    pthread_mutex_lock(&profilelock);
+    __atomic_fetch_and(&observers, ~OBSERVE_PROFILE, __ATOMIC_RELAXED);
+    top = profiletop;
+    profiletop = 0;
+    pthread_mutex_unlock(&profilelock);
+
+    mymalloc_profile_report(STDERR_FILENO, top);
+}
+
+/**
+ * Fork handlers keeping the allocator's locks consistent across fork(): the child would otherwise inherit any of
+ * them locked if another thread held it at that moment, and deadlock on its first allocation. They are taken in
+ * the order the allocator nests them. The child also stops tracing: the records it has buffered belong to the
+ * parent, which writes them itself, and its own calls would be mixed into the parent's trace.
+ */
+static void forkPrepare () {
+    pthread_mutex_lock(&heaplock);
+    pthread_mutex_lock(&tracelock);
+    pthread_mutex_lock(&profilelock);
+    pthread_mutex_lock(&statslock);
+}
+
+static void forkParent () {
+    pthread_mutex_unlock(&statslock);
+    pthread_mutex_unlock(&profilelock);
+    pthread_mutex_unlock(&tracelock);
+    pthread_mutex_unlock(&heaplock);
+}
+
+static void forkChild () {
+    if (tracefd >= 0) {
+        __atomic_fetch_and(&observers, ~OBSERVE_TRACE, __ATOMIC_RELAXED);
+        tracebuffered = 0;
+        close(tracefd); // the parent's descriptor keeps the file locked
+        tracefd = -1;
+    }
+    forkParent();
+}
+
+/**
+ * Sets the heap up before main() runs, so allocations never pay for it. The locked paths still check
+ * heapready, for allocations made by constructors that happen to run before this one.
+ */
+__attribute__((constructor)) static void mymallocInit () {
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+    heapEnsureReady();
+}
+
+/**
+ * Passes a successful call on to whichever of tracing and profiling is switched on.
+ * @param[in] TRACE_MALLOC, TRACE_ALIGNED_ALLOC, TRACE_FREE or TRACE_REALLOC
+ * @param[in] file wherein user made the call
+ * @param[in] line number from file wherein user made the call
+ * @param[in] user data block handed out, freed or resized to
+ * @param[in] requested size
+ * @param[in] alignment for TRACE_ALIGNED_ALLOC, block before resizing for TRACE_REALLOC
+ */
+static void observe (uint8_t op, char *file, int line, void *ptr, size_t size, uint64_t extra) {
+    int active = __atomic_load_n(&observers, __ATOMIC_RELAXED);
+
+    if (active & OBSERVE_TRACE) {
+        traceRecord(op, file, line, ptr, size, extra);
+    }
+    if (active & OBSERVE_PROFILE) {
+        profileRecord(op, file, line, ptr, size, extra);
+    }
+}
+
+/**
+ * Tells how much memory the allocator is holding: myblock plus every chunk it has mapped, whether or not
+ * the memory is currently handed out. Cheap enough to call after every allocation.
+ * @param[out] bytes held
+ */
+size_t mymalloc_footprint () {
+    return __atomic_load_n(&mappedbytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Switches the placement policy used to pick a free heap block for every later request, see MYMALLOC_BEST_FIT.
+ * Blocks already handed out stay where they are. Requests served by thread caches, slabs and dedicated mappings
+ * do not depend on it.
+ * @param[in] MYMALLOC_BEST_FIT, MYMALLOC_FIRST_FIT or MYMALLOC_NEXT_FIT
+ * @param[out] 1 on success, 0 if the policy is unknown
+ */
+int mymalloc_set_policy (int policy) {
+    if (policy != MYMALLOC_BEST_FIT && policy != MYMALLOC_FIRST_FIT && policy != MYMALLOC_NEXT_FIT) {
+        reportError("Malloc Error: User attempted to select unknown placement policy %d\n", policy);
+        return 0;
+    }
+
+    heapEnsureReady(); // so MYMALLOC_POLICY does not override it later
+    pthread_mutex_lock(&heaplock);
+    placementpolicy = policy;
+    nextfitrover = 0;
+    pthread_mutex_unlock(&heaplock);
+    return 1;
+}
+
+/**
+ * Tells which placement policy is in use.
+ * @param[out] MYMALLOC_BEST_FIT, MYMALLOC_FIRST_FIT or MYMALLOC_NEXT_FIT
+ */
+int mymalloc_policy () {
+    int policy = 0;
+
+    heapEnsureReady();
+    pthread_mutex_lock(&heaplock);
+    policy = placementpolicy;
+    pthread_mutex_unlock(&heaplock);
+    return policy;
+}
+
+/**
+ * Tells how many bytes of user data a block handed out by mymalloc() can hold, which may be a little more than
+ * requested. Does not check the pointer, which must be valid.
+ * @param[in] user data block, or NULL
+ * @param[out] usable size in bytes, 0 for NULL
+ */
+size_t mymalloc_usable_size (void *ptr) {
+    Chunk *chunk = (ptr != NULL) ? chunkOf(ptr) : NULL;
+
+    if (chunk == NULL) {
+        return 0;
+    }
+
+    return (chunk->kind == 'S') ? chunk->objectsize : blockLength(((MetaData*) ptr) - 1);
+}
+
+/**
+ * Arenas serve many short lived objects that all die together, such as everything allocated while handling one
+ * request. arena_alloc() only moves a pointer through the current region, and arena_reset() takes everything
+ * back at once by moving it to the start again, so objects are never freed one by one. Regions are mapped
+ * with mapAligned() apart from the heap; the page map does not know them, so myfree() rejects arena objects.
+ * The first region holds the Arena itself. Regions are kept across resets and only unmapped by arena_destroy().
+ */
+typedef struct ArenaRegion {
+    struct ArenaRegion *next; // next region of the same arena, used again in order after a reset
+    size_t length; // bytes mapped, including this header
+} ArenaRegion;
+
+struct Arena {
+    ArenaRegion *first; // region holding the Arena, where allocation starts again after a reset
+    ArenaRegion *current; // region objects are being cut from
+    char *next; // where the next object starts in current
+    char *end; // end of current
+};
+
+#define ARENA_REGION_HEADER ALIGN_UP(sizeof(ArenaRegion), SIZE_GRANULE)
+
+/**
+ * Maps a region large enough for the given object.
+ * @param[in] object size (already rounded up)
+ * @param[out] the new region, or NULL if the system is out of memory
+ */
+static ArenaRegion* arenaMapRegion (size_t size) {
+    size_t length = ALIGN_UP(ARENA_REGION_HEADER + size, ARENA_REGION_SIZE);
+    ArenaRegion *region = mapAligned(length);
+
+    if (region != NULL) {
+        region->next = NULL;
+        region->length = length;
+    }
+
+    return region;
+}
+
+/**
+ * Moves allocation to the next region that can hold the given object, mapping one if there is none.
+ * @param[in] arena
+ * @param[in] object size (already rounded up)
+ * @param[out] 1 on success, 0 if the system is out of memory
+ */
+static int arenaNextRegion (Arena *arena, size_t size) {
+    ArenaRegion *region = arena->current->next;
+
+    if (region == NULL || region->length - ARENA_REGION_HEADER < size) { // a region for a larger object goes in before it
+        region = arenaMapRegion(size);
+        if (region == NULL) {
+            return 0;
+        }
+        region->next = arena->current->next;
+        arena->current->next = region;
+    }
+
+    arena->current = region;
+    arena->next = (char*) region + ARENA_REGION_HEADER;
+    arena->end = (char*) region + region->length;
+    return 1;
+}
+
+/**
+ * Creates an empty arena. Each arena may be used by one thread at a time.
+ * @param[out] the new arena, or NULL if the system is out of memory
+ */
+Arena* arena_create () {
+    ArenaRegion *region = arenaMapRegion(ALIGN_UP(sizeof(Arena), SIZE_GRANULE));
+    Arena *arena = NULL;
+
+    if (region == NULL) {
+        reportError("Arena Error: Not enough memory to create an arena\n");
+        return NULL;
+    }
+
+    arena = (Arena*) ((char*) region + ARENA_REGION_HEADER);
+    arena->first = region;
+    arena_reset(arena);
+    return arena;
+}
+
+/**
+ * Hands out an object from an arena. It stays valid until the arena is reset or destroyed, and must not be
+ * passed to free().
+ * @param[in] arena
+ * @param[in] user requested size
+ * @param[out] start of the object, SIZE_GRANULE aligned, or NULL if the request cannot be served
+ */
+void* arena_alloc (Arena *arena, size_t size) {
+    void *ptr = NULL;
+
+    if (arena == NULL || size == 0 || size > MAX_REQUEST_SIZE) {
+        reportError("Arena Error: User attempted to allocate %zu bytes of memory from %s\n", size, (arena == NULL) ? "no arena" : "an arena");
+        return NULL;
+    }
+
+    size = ALIGN_UP(size, SIZE_GRANULE);
+    if ((size_t) (arena->end - arena->next) < size && !arenaNextRegion(arena, size)) {
+        reportError("Arena Error: Not enough memory to allocate %zu bytes of memory from an arena\n", size);
+        return NULL;
+    }
+
+    ptr = arena->next;
+    arena->next += size;
+    return ptr;
+}
+
+/**
+ * Takes back every object of an arena at once, keeping its regions mapped for the objects that follow.
+ * Takes constant time however many objects were handed out.
+ * @param[in] arena
+ */
+void arena_reset (Arena *arena) {
+    if (arena == NULL) {
+        return;
+    }
+
+    arena->current = arena->first;
+    arena->next = (char*) arena->first + ARENA_REGION_HEADER + ALIGN_UP(sizeof(Arena), SIZE_GRANULE);
+    arena->end = (char*) arena->first + arena->first->length;
+}
+
+/**
+ * Takes back every object of an arena and the arena itself, unmapping its regions. Takes time in the
+ * number of regions, not the number of objects.
+ * @param[in] arena
+ */
+void arena_destroy (Arena *arena) {
+    ArenaRegion *region = NULL;
+    ArenaRegion *next = NULL;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    for (region = arena->first; region != NULL; region = next) {
+        next = region->next;
+        unmapAligned(region, region->length);
+    }
+}
+
 /**
- * Linked list function to coalesce adjacent free user data blocks. Doing so
- * provides the user with the most amount of data to allocate. 
- */ 
-void coalesce () {
-    MetaData *head = NULL; // head pointer to linked list in myblock
-    MetaData *curr = NULL; // curr pointer to traverse linked list
+ * Reports a request that cannot be served and counts the failure. Kept out of line, away from the paths
+ * that succeed.
+ * @param[in] requested size
+ * @param[in] file wherein user made the call
+ * @param[in] line number from file wherein user made the call
+ * @param[out] NULL, for the caller to return
+ */
+static void* allocationFailed (size_t size, char* file, int line) __attribute__((cold, noinline));
 
-    // printf("Coalescing...\n");
+static void* allocationFailed (size_t size, char* file, int line) {
+#ifdef MYMALLOC_NO_DIAGNOSTICS
+    (void) file;
+    (void) line;
+#endif
+    if (size == 0) {
+        reportError("Malloc Error: User attempted to allocate 0 bytes of memory in file: %s on line %d\n", file, line);
+    } else if ((ssize_t) size < 0) { // a negative number converted to size_t
+        reportError("Malloc Error: User attempted to allocate a negative number of bytes of memory in file: %s on line %d\n", file, line);
+    } else {
+        reportError("Malloc Error: User attempted to allocate more than available number of bytes of memory in file: %s on line: %d\n", file, line);
+    }
+    statsFailure(size);
+    return NULL;
+}
 
-    head = (MetaData*) myblock;
-    curr = head;
-    while (curr != NULL) {
-        if (curr->next == NULL) { // no potential adjacent user data block to coalesce with current
-            return;
-        } else {
-            if (curr->blockstatus == 'F' && (curr->next)->blockstatus == 'F') { // adjacent blocks are free, so coalesce them
-                curr->blocklength = curr->blocklength + (curr->next)->blocklength + METADATA_SIZE; // compute total size of current user data block size + next userdata block size + extra MetaData size
-                curr->next = (curr->next)->next; // fix linking after deleting next user data block
-            } else {
-                curr = curr->next;
-            }
+/**
+ * Does the work of mymalloc() for every request its fast path does not serve. Also used by myrealloc().
+ */
+static void* allocate (size_t size, char* file, int line) __attribute__((noinline));
+
+static void* allocate (size_t size, char* file, int line) {
+    void *ptr = NULL; // user data block handed out
+    MetaData *curr = NULL; // MetaData node of a large user data block
+    unsigned int index = 0; // small bin index of the request, if it is small
+
+    /* edge cases where invalid amount of bytes was requested by user: 0 wraps around to the largest size_t */
+    if (__builtin_expect(size - 1 >= MAX_REQUEST_SIZE, 0)) {
+        return allocationFailed(size, file, line);
+    }
+
+    if (size <= SLAB_MAX_SIZE) { // tiny requests take a whole object of their slab class
+        size = (size_t) SLAB_MIN_SIZE << slabClass(size);
+    } else { // heap blocks are sized so the next MetaData node keeps user data SIZE_GRANULE aligned
+        size = BLOCK_SIZE(size);
+    }
+
+    /* small requests are served from this thread's cache without locking whenever possible */
+    if (size < SMALL_BIN_LIMIT) {
+        index = TCACHE_INDEX(size);
+        if (tcache.entries[index] != NULL) {
+            ptr = tcache.entries[index];
+            tcache.entries[index] = TCACHE_NEXT(ptr);
+            tcache.counts[index]--;
+            statsUpdate((long long) size); // cached blocks are exactly their size
+            return ptr;
         }
     }
 
-    return;
+    if (size >= MMAP_THRESHOLD) {
+        heapEnsureReady(); // sets up pagesize
+        curr = largeAlloc(size, SIZE_GRANULE);
+        ptr = (curr != NULL) ? (void*) (curr + 1) : NULL;
+    } else {
+        pthread_mutex_lock(&heaplock);
+        if (__builtin_expect(!heapready, 0)) {
+            heapInit();
+        }
+        ptr = blockAlloc(size);
+        if (ptr == NULL && tcacheFlushAll(&tcache)) { // the space may be sitting in this thread's cache
+            ptr = blockAlloc(size);
+        }
+        if (ptr != NULL && size < SMALL_BIN_LIMIT && !tcache.shutdown) {
+            tcacheRefill(index, size);
+        }
+        pthread_mutex_unlock(&heaplock);
+    }
+
+    if (ptr == NULL) {
+        return allocationFailed(size, file, line);
+    }
+
+    statsUpdate((long long) ((size <= SLAB_MAX_SIZE) ? size : blockLength(((MetaData*) ptr) - 1))); // a heap block can be a little larger
+    return ptr;
+}
+
+/**
+ * Slow path of mymalloc(): allocate() followed by passing the call on to tracing and profiling. Kept out of
+ * line so the fast path needs no stack frame.
+ */
+static void* allocateObserved (size_t size, char* file, int line) __attribute__((noinline));
+
+static void* allocateObserved (size_t size, char* file, int line) {
+    void *ptr = allocate(size, file, line);
+
+    if (ptr != NULL && __atomic_load_n(&observers, __ATOMIC_RELAXED)) {
+        observe(TRACE_MALLOC, file, line, ptr, size, 0);
+    }
+
+    return ptr;
 }
 
 /**
  * mymalloc() is a better version of malloc() that does not allow the user to do Bad Things. Allows the user
  * to request sizes of data to use for their own needs, but also provides errors if invalid requests are made.
+ * Safe to call from several threads at once.
  * @param[in] user requested size
  * @param[in] file wherein user called malloc, to report errors if an invalid call to malloc occurred
  * @param[in] line number from file wherein user called malloc, to report errors if an invalid call to malloc occurred
  * @param[out] void* pointer to start address of user data block
  */ 
 void* mymalloc (size_t size, char* file, int line) {
-    MetaData *head = NULL; // head pointer to linked list in myblock
-    MetaData *curr = NULL; // curr pointer to traverse linked list
-    MetaData *new_node = NULL; // new MetaData node to be added when new memory is allocated by user
+    unsigned int blocksize = 0; // user data block size of a small request
+    unsigned int index = 0; // thread cache index of a small request
+    void *ptr = NULL;
 
-    /* edge cases where invalid amount of bytes was requested by user */
-    if (size == 0) {
-        printf("Malloc Error: User attempted to allocate 0 bytes of memory in file: %s on line %d\n", file, line);
-        return NULL;
-    } else if (size < 0) {
-        printf("Malloc Error: User attempted to allocate a negative number of bytes of memory in file: %s on line %d\n", file, line);
+    /* fast path: a small request this thread has a cached block for, while nothing observes the calls and no stats are due for publishing */
+    if (__builtin_expect(size - 1 < FAST_MAX_SIZE, 1)) {
+        blocksize = fastsizes[(size - 1) / 8];
+        index = TCACHE_INDEX(blocksize);
+        ptr = tcache.entries[index];
+        if (__builtin_expect(ptr != NULL && __atomic_load_n(&observers, __ATOMIC_RELAXED) == 0 && statsFits(blocksize), 1)) {
+            tcache.entries[index] = TCACHE_NEXT(ptr);
+            tcache.counts[index]--;
+            statsIncrement(&threadstats.allocs[fastclasses[index]]);
+            statsAdd(blocksize); // cached blocks are exactly their size
+            return ptr;
+        }
+    }
+
+    return allocateObserved(size, file, line);
+}
+
+/**
+ * myaligned_alloc() is mymalloc() for user data that has to start at a multiple of the given alignment,
+ * such as cache line aligned counters or page aligned buffers. Every mymalloc() pointer is already
+ * SIZE_GRANULE aligned, so only larger alignments take the padded path.
+ * @param[in] alignment, a power of two
+ * @param[in] user requested size
+ * @param[in] file wherein user called aligned_alloc, to report errors if an invalid call occurred
+ * @param[in] line number from file wherein user called aligned_alloc, to report errors if an invalid call occurred
+ * @param[out] void* pointer to start address of user data block
+ */
+void* myaligned_alloc (size_t alignment, size_t size, char* file, int line) {
+    MetaData *curr = NULL; // MetaData node of the user data block handed out
+    size_t blocksize = 0; // user data block size the request is rounded up to
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        reportError("Malloc Error: User attempted to allocate memory with an alignment that is not a power of two in file: %s on line: %d\n", file, line);
+        statsFailure(size);
         return NULL;
-    } else if (size >= MYBLOCK_SIZE) {
-        printf("Malloc Error: User attempted to allocate more than available number of bytes of memory in file: %s on line: %d\n", file, line); 
-        return NULL;        
     }
 
-    /* initialization of MetaData linked list on first pass */    
-    if (myblock[0] == 0) {
-        head = (MetaData*) myblock; // pointing head pointer of MetaData linked list to 0th index of myblock on first pass
-        head->blockstatus = 'F';
-        head->blocklength = MYBLOCK_SIZE - METADATA_SIZE;
-        head->next = NULL;
+    /* slab objects are aligned to their own size, so a big enough slab class already does the job; these calls are traced as the mymalloc() they turn into */
+    if (alignment <= SIZE_GRANULE || size == 0) {
+        return mymalloc(size, file, line); // also reports invalid sizes
+    } else if (alignment > MAX_REQUEST_SIZE || size > MAX_REQUEST_SIZE - alignment) {
+        return allocationFailed(size, file, line); // a plain block would not have the alignment
+    } else if (size <= SLAB_MAX_SIZE && alignment <= SLAB_MAX_SIZE) {
+        return mymalloc((size < alignment) ? alignment : size, file, line);
+    }
+
+    blocksize = (size <= SLAB_MAX_SIZE) ? MIN_HEAP_BLOCK : BLOCK_SIZE(size);
+    if (blocksize + alignment + METADATA_SIZE + MIN_BLOCK_SIZE >= MMAP_THRESHOLD) {
+        heapEnsureReady(); // sets up pagesize
+        curr = largeAlloc(blocksize, alignment);
+    } else {
+        pthread_mutex_lock(&heaplock);
+        if (__builtin_expect(!heapready, 0)) {
+            heapInit();
+        }
+        curr = heapAllocAligned((unsigned int) blocksize, alignment);
+        pthread_mutex_unlock(&heaplock);
+    }
+
+    if (curr == NULL) {
+        return allocationFailed(size, file, line);
+    }
+
+    statsUpdate(blockLength(curr));
+    if (__atomic_load_n(&observers, __ATOMIC_RELAXED)) {
+        observe(TRACE_ALIGNED_ALLOC, file, line, curr + 1, size, alignment);
+    }
+    return (void*) (curr + 1);
+}
+
+/**
+ * Checks that a pointer handed in by the user is the start of a user data block that is currently handed
+ * out, printing the matching error otherwise. Chunks and blocks handed to this thread stay put until it
+ * frees them, so no lock is needed.
+ * @param[in] pointer to check
+ * @param[in] capitalized name of the calling function for error messages, e.g. "Free"
+ * @param[in] verb used in error messages, e.g. "free"
+ * @param[in] file wherein user made the call, to report errors
+ * @param[in] line number from file wherein user made the call, to report errors
+ * @param[out] set to the chunk holding ptr
+ * @param[out] set to the size of the user data block
+ * @param[out] 1 if ptr is valid, 0 if an error was printed
+ */
+static int checkPointer (void *ptr, const char *caller, const char *verb, char *file, int line, Chunk **chunkout, size_t *sizeout) {
+    MetaData *curr = NULL; // MetaData node belonging to ptr
+    void *cached = NULL; // traverses this thread's cache when looking for a double free
+    Chunk *chunk = NULL; // chunk ptr points into
+    size_t size = 0; // user data block size
+
+#ifdef MYMALLOC_NO_DIAGNOSTICS
+    (void) caller;
+    (void) verb;
+    (void) file;
+    (void) line;
+#endif
+    /* edge case where memory has not yet been initialized */
+    if (!__atomic_load_n(&heapready, __ATOMIC_ACQUIRE)) {
+        reportError("%s Error: User attempted to %s invalid pointer in file: %s on line: %d\n", caller, verb, file, line);
+        return 0;
     }
 
+    chunk = chunkOf(ptr);
+
     /**
-     * Coalescing the free memory blocks (if any) before checking to malloc. This
-     * could potentially provide the user with the space they are asking for
-     * rather than just telling them that there is not enough space.
+     * A slab object has no MetaData: it is valid if it starts on an object boundary and its
+     * occupancy bit is set.
      */
-    coalesce(); 
+    if (chunk != NULL && chunk->kind == 'S') {
+        if ((char*) ptr < chunk->objects || (char*) ptr >= chunk->end) {
+            reportError("%s Error: User attempted to %s pointer outside of memory block in file: %s on line: %d\n", caller, verb, file, line);
+            return 0;
+        }
+        if ((size_t) ((char*) ptr - chunk->objects) % chunk->objectsize != 0) {
+            reportError("%s Error: User attempted to %s invalid pointer in file: %s line: %d\n", caller, verb, file, line);
+            return 0;
+        }
+        if (!slabInUse(chunk, ptr)) {
+            reportError("%s Error: User attempted to %s pointer to already free user data block in file: %s line: %d\n", caller, verb, file, line);
+            return 0;
+        }
+        size = chunk->objectsize;
+    } else {
+        /* edge case where user inputted pointer is outside of memory bounds */
+        if (chunk == NULL || (char*) ptr <= (char*) chunk->first || (char*) ptr >= chunk->end) {
+            reportError("%s Error: User attempted to %s pointer outside of memory block in file: %s on line: %d\n", caller, verb, file, line);
+            return 0;
+        }
 
-    head = (MetaData*) myblock; // pointing head pointer of MetaData linked list to 0th index of myblock for subsequent passes after first
-    curr = head;
-    while (curr != NULL) {
-        if (curr->blockstatus == 'U') { // current user data block is occupied
-            curr = curr->next;
-        } else {
-            if (curr->blocklength == size) { // user requested data fits exactly within current MetaData block
-                curr->blockstatus = 'U'; // current MetaData block is occupied now
-                
-                curr++; // increment curr by sizeof(MetaData) bytes to point to user data block
-                return (void*)(curr);
-            } else if (curr->blocklength < (size + METADATA_SIZE)) { // free MetaData block, but not large enough
-                curr = curr->next;
-            } else if (curr->blocklength >= (size + METADATA_SIZE)) {
-                // new MetaData node is sitting at location: current MetaData address + user requested size + METADATA_SIZE
-                // example: current MetaData at address 0
-                // user requested size is 100 bytes
-                // METADATA_SIZE is 16 bytes
-                // new MetaData node is sitting at 0 + 100 + 16 = address 116
-                new_node = (MetaData*) (void*) ((void*)curr + size + METADATA_SIZE);
-                new_node->next = curr->next;
-                new_node->blockstatus = 'F';
-                new_node->blocklength = curr->blocklength - size - METADATA_SIZE;
-
-                curr->next = new_node;
-                curr->blocklength = size;
-                curr->blockstatus = 'U';
-
-                curr++; // increment curr by sizeof(MetaData) bytes to point to user data block
-                return (void*)(curr);
-            }
-        }
-    }
-
-    printf("Malloc Error: User attempted to allocate more than available number of bytes of memory in file: %s on line: %d\n", file, line); 
-    return NULL;
+        /**
+         * The MetaData node of a valid pointer sits right before it. In a heap chunk it has to start on a granule
+         * that the side bitmap marks as a node start; otherwise the pointer is somewhere inside a user data block.
+         * A large chunk only has one node.
+         */
+        curr = ((MetaData*) ptr) - 1;
+        if (chunk->kind == 'L') {
+            if (curr != chunk->first) {
+                reportError("%s Error: User attempted to %s invalid pointer in file: %s line: %d\n", caller, verb, file, line);
+                return 0;
+            }
+        } else if (curr < chunk->first || (unsigned long) ((char*) curr - (char*) chunk->first) % SIZE_GRANULE != 0 || !isBlockStart(chunk, curr)) {
+            reportError("%s Error: User attempted to %s invalid pointer in file: %s line: %d\n", caller, verb, file, line);
+            return 0;
+        }
+
+        /* a marked node whose checksum no longer matches was overwritten, most likely by a user data overflow */
+        if (curr->checksum != blockChecksum(curr, blockInfo(curr))) {
+            reportError("%s Error: User attempted to %s pointer with corrupted MetaData in file: %s line: %d\n", caller, verb, file, line);
+            return 0;
+        }
+
+        if (!isUsed(curr)) { // valid pointer found, but it is already a free user data block
+            reportError("%s Error: User attempted to %s pointer to already free user data block in file: %s line: %d\n", caller, verb, file, line);
+            return 0;
+        }
+        size = blockLength(curr);
+    }
+
+    /* small blocks freed by this thread may sit in its cache, which is at most TCACHE_COUNT long per size and so cheap to search */
+    if (size < SMALL_BIN_LIMIT) {
+        for (cached = tcache.entries[TCACHE_INDEX(size)]; cached != NULL; cached = TCACHE_NEXT(cached)) {
+            if (cached == ptr) {
+                reportError("%s Error: User attempted to %s pointer to already free user data block in file: %s line: %d\n", caller, verb, file, line);
+                return 0;
+            }
+        }
+    }
+
+    *chunkout = chunk;
+    *sizeout = size;
+    return 1;
+}
+
+/**
+ * Does the work of myfree() once the pointer has been checked.
+ * @param[in] valid pointer to a used user data block
+ * @param[in] chunk ptr points into
+ * @param[in] user data block size
+ */
+static void release (void *ptr, Chunk *chunk, size_t size) {
+    unsigned int index = 0; // small bin index of the block, if it is small
+
+    statsUpdate(-(long long) size);
+    if (chunk->kind == 'L') {
+        largeFree(chunk);
+        return;
+    }
+
+    /* small blocks go to this thread's cache, unless the thread is exiting and its cache has been shut down */
+    if (size < SMALL_BIN_LIMIT && !tcache.shutdown) {
+        index = TCACHE_INDEX(size);
+        if (tcache.counts[index] < TCACHE_COUNT) {
+            TCACHE_NEXT(ptr) = tcache.entries[index];
+            tcache.entries[index] = ptr;
+            tcache.counts[index]++;
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&heaplock);
+    if (size < SMALL_BIN_LIMIT && !tcache.shutdown) { // cache for this size is full, so hand all of it back along with ptr
+        tcacheFlush(&tcache, index);
+    }
+    blockFree(ptr); // current user data block was being used, so make it free
+    pthread_mutex_unlock(&heaplock);
+    return;
 }
 
 /**
  * myFree() is a better version of free() that does not allow the user to do Bad Things. Allows the 
  * user to free valid pointers to data that had been previously allocated with mymalloc(), 
- * but also provides errors if invalid requests are made.
+ * but also provides errors if invalid requests are made. Safe to call from several threads at once.
  * @param[in] pointer to user data block to be freed
  * @param[in] file wherein user called malloc, to report errors if an invalid call to malloc occurred
  * @param[in] line number from file wherein user called malloc, to report errors if an invalid call to malloc occurred
  */ 
 void myfree (void* ptr, char* file, int line) {
-    MetaData *head = NULL; // head pointer to linked list in myblock
-    MetaData *curr = NULL; // curr pointer to traverse linked list
-    MetaData *addressZero = NULL; // pointer to first address, equivalent to index 0 in myblock
+    Chunk *chunk = NULL; // chunk ptr points into
+    size_t size = 0; // user data block size
 
-    /* edge case where memory has not yet been initialized */
-    if (myblock[0] == 0) {
-        printf("Free Error: User attempted to free invalid pointer in file: %s on line: %d\n", file, line);
+    if (!checkPointer(ptr, "Free", "free", file, line, &chunk, &size)) {
+        return;
+    }
+
+    if (__atomic_load_n(&observers, __ATOMIC_RELAXED)) {
+        observe(TRACE_FREE, file, line, ptr, size, 0);
+    }
+    release(ptr, chunk, size);
+}
+
+/**
+ * Cuts a used MetaData node into blocks of the given size lying back to back, the last one keeping whatever
+ * is left over. Caller must hold heaplock.
+ * @param[in] used MetaData node at least count * (size + METADATA_SIZE) - METADATA_SIZE long
+ * @param[in] size of each block (see BLOCK_SIZE)
+ * @param[in] number of blocks
+ * @param[out] where the user data blocks are stored, in address order
+ */
+static void carveRun (MetaData *node, unsigned int size, size_t count, void **ptrs) {
+    Chunk *chunk = chunkOf(node);
+    unsigned int remaining = blockLength(node); // length of the block not cut yet
+    MetaData *next = NULL;
+
+    for (size_t i = 0; i + 1 < count; i++) {
+        next = (MetaData*) (void*) ((char*) (node + 1) + size);
+        remaining -= size + METADATA_SIZE;
+        setBlockInfo(next, remaining, BLOCK_USED | PREV_USED);
+        markBlockStart(chunk, next);
+        setBlockLength(node, size);
+        ptrs[i] = node + 1;
+        node = next;
+    }
+    ptrs[count - 1] = node + 1;
+}
+
+/**
+ * Moves the pointer at root down the max-heap made of ptrs[0, count) until it is larger than its children.
+ */
+static void siftDown (void **ptrs, size_t root, size_t count) {
+    void *value = ptrs[root];
+    size_t child = 0;
+
+    while ((child = 2 * root + 1) < count) {
+        if (child + 1 < count && (uintptr_t) ptrs[child + 1] > (uintptr_t) ptrs[child]) {
+            child++;
+        }
+        if ((uintptr_t) ptrs[child] <= (uintptr_t) value) {
+            break;
+        }
+        ptrs[root] = ptrs[child];
+        root = child;
+    }
+    ptrs[root] = value;
+}
+
+/**
+ * Sorts pointers by address with heapsort, which needs no memory of its own. Pointers handed out by
+ * mymalloc_batch() are usually already in order, which is checked for first.
+ * @param[in] pointers, NULL ones end up first
+ * @param[in] number of pointers
+ */
+static void sortPointers (void **ptrs, size_t count) {
+    void *largest = NULL;
+    size_t sorted = 1; // length of the sorted prefix
+
+    while (sorted < count && (uintptr_t) ptrs[sorted - 1] <= (uintptr_t) ptrs[sorted]) {
+        sorted++;
+    }
+    if (sorted >= count) {
         return;
     }
 
-    addressZero = (MetaData*) myblock;
+    for (size_t root = count / 2; root-- > 0;) {
+        siftDown(ptrs, root, count);
+    }
+    for (size_t end = count; end-- > 1;) {
+        largest = ptrs[0];
+        ptrs[0] = ptrs[end];
+        ptrs[end] = largest;
+        siftDown(ptrs, 0, end);
+    }
+}
+
+/**
+ * Frees checked user data blocks in a single sweep. Heap blocks lying back to back are first merged into
+ * one used block, so a whole run of them costs a single heapFree(). Takes heaplock once.
+ * @param[in] valid pointers to used user data blocks sorted by address, NULL ones are skipped; each is
+ *            set to NULL once freed, since the chunk it pointed into may be gone
+ * @param[in] number of pointers
+ */
+static void releaseSorted (void **ptrs, size_t count) {
+    Chunk *chunk = NULL;
+    MetaData *node = NULL; // first node of a run of back to back blocks
+    MetaData *next = NULL;
+    unsigned int length = 0; // length of the run so far
+    size_t object = 0; // index of a slab object
+    unsigned long long bits = 0; // slab objects of one occupancy word being freed
+    size_t j = 0;
+
+    pthread_mutex_lock(&heaplock);
+    for (size_t i = 0; i < count; i = j) {
+        j = i + 1;
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+        chunk = chunkOf(ptrs[i]);
+        if (chunk->kind == 'S') { // objects sharing an occupancy word are freed together
+            object = ((char*) ptrs[i] - chunk->objects) / chunk->objectsize;
+            bits = 1ULL << (object % 64);
+            ptrs[i] = NULL;
+            for (; j < count && ptrs[j] != NULL && (char*) ptrs[j] >= chunk->objects && (char*) ptrs[j] < chunk->end &&
+                   (char*) ptrs[j] < chunk->objects + (object / 64 + 1) * 64 * chunk->objectsize; j++) {
+                bits |= 1ULL << ((size_t) ((char*) ptrs[j] - chunk->objects) / chunk->objectsize % 64);
+                ptrs[j] = NULL;
+            }
+            slabFreeRun(chunk, object / 64, bits);
+            continue;
+        } else if (chunk->kind == 'L') { // unmapped below, without heaplock
+            continue;
+        }
+
+        node = ((MetaData*) ptrs[i]) - 1;
+        length = blockLength(node);
+        for (; j < count && ptrs[j] == (void*) ((char*) (node + 1) + length + METADATA_SIZE); j++) {
+            next = ((MetaData*) ptrs[j]) - 1;
+            clearBlockStart(chunk, next);
+            length += METADATA_SIZE + blockLength(next);
+            ptrs[j] = NULL;
+        }
+        setBlockLength(node, length);
+        heapFree(node);
+        ptrs[i] = NULL;
+    }
+    pthread_mutex_unlock(&heaplock);
+
+    for (size_t i = 0; i < count; i++) { // only large blocks are left
+        if (ptrs[i] != NULL) {
+            largeFree(chunkOf(ptrs[i]));
+            ptrs[i] = NULL;
+        }
+    }
+}
+
+/**
+ * mymalloc_batch() allocates several blocks of the same size at once. Heap blocks are carved back to back out
+ * of as few free blocks as possible, and heaplock is taken once for the whole batch rather than per block.
+ * Either every block is allocated or none is. Blocks are freed with free() or free_batch() as usual.
+ * @param[in] user requested size of each block
+ * @param[in] number of blocks
+ * @param[in] where the blocks are stored, count entries
+ * @param[in] file wherein user called malloc_batch, to report errors if an invalid call occurred
+ * @param[in] line number from file wherein user called malloc_batch, to report errors if an invalid call occurred
+ * @param[out] 1 if every block was allocated, 0 if none was and the entries of ptrs were set to NULL
+ */
+int mymalloc_batch (size_t size, size_t count, void **ptrs, char* file, int line) {
+    size_t blocksize = 0; // size of each block (already rounded up)
+    size_t done = 0; // blocks allocated so far
+    size_t run = 0; // blocks carved out of the current free block
+    MetaData *node = NULL;
+
+    if (count == 0) {
+        return 1;
+    } else if (ptrs == NULL || size == 0 || size > MAX_REQUEST_SIZE) {
+        reportError("Malloc Error: User attempted to allocate an invalid batch of %zu blocks of %zu bytes of memory in file: %s on line: %d\n", count, size, file, line);
+        statsFailure(size);
+        return 0;
+    }
+
+    blocksize = (size <= SLAB_MAX_SIZE) ? (size_t) SLAB_MIN_SIZE << slabClass(size) : BLOCK_SIZE(size);
+    if (blocksize >= MMAP_THRESHOLD) { // every large block needs its own mapping anyway
+        heapEnsureReady(); // sets up pagesize
+        for (; done < count; done++) {
+            node = largeAlloc(blocksize, SIZE_GRANULE);
+            if (node == NULL) {
+                break;
+            }
+            ptrs[done] = node + 1;
+        }
+    } else {
+        pthread_mutex_lock(&heaplock);
+        if (__builtin_expect(!heapready, 0)) {
+            heapInit();
+        }
+        while (done < count) {
+            if (blocksize <= SLAB_MAX_SIZE) { // up to a whole occupancy word of objects at a time
+                run = slabAllocRun(blocksize, count - done, ptrs + done);
+                if (run == 0 && tcacheFlushAll(&tcache)) { // the space may be sitting in this thread's cache
+                    run = slabAllocRun(blocksize, count - done, ptrs + done);
+                }
+                if (run == 0) {
+                    break;
+                }
+                done += run;
+                continue;
+            }
+
+            // as many blocks as fit below MMAP_THRESHOLD come out of a single free block
+            run = (MMAP_THRESHOLD - 1 + METADATA_SIZE) / (blocksize + METADATA_SIZE);
+            run = (run < count - done) ? run : count - done;
+            node = heapAlloc((unsigned int) (run * (blocksize + METADATA_SIZE) - METADATA_SIZE));
+            if (node == NULL && tcacheFlushAll(&tcache)) {
+                node = heapAlloc((unsigned int) (run * (blocksize + METADATA_SIZE) - METADATA_SIZE));
+            }
+            if (node == NULL) {
+                break;
+            }
+            carveRun(node, (unsigned int) blocksize, run, ptrs + done);
+            done += run;
+        }
+        pthread_mutex_unlock(&heaplock);
+    }
+
+    if (done < count) { // hand back what was allocated so the batch fails as a whole
+        sortPointers(ptrs, done);
+        releaseSorted(ptrs, done);
+        for (size_t i = 0; i < count; i++) {
+            ptrs[i] = NULL;
+        }
+        allocationFailed(size, file, line);
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        statsUpdate((long long) ((blocksize <= SLAB_MAX_SIZE) ? blocksize : blockLength(((MetaData*) ptrs[i]) - 1)));
+        if (__atomic_load_n(&observers, __ATOMIC_RELAXED)) {
+            observe(TRACE_MALLOC, file, line, ptrs[i], size, 0);
+        }
+    }
+    return 1;
+}
+
+/**
+ * myfree_batch() frees several blocks at once. The pointers are checked like myfree() does, sorted by
+ * address, and then freed in one sweep under a single heaplock, merging blocks that lie back to back
+ * before they go to the bins. Invalid pointers are reported and skipped, NULL ones are ignored.
+ * Every entry of ptrs is set to NULL.
+ * @param[in] pointers to user data blocks to be freed
+ * @param[in] number of pointers
+ * @param[in] file wherein user called free_batch, to report errors if an invalid call occurred
+ * @param[in] line number from file wherein user called free_batch, to report errors if an invalid call occurred
+ */
+void myfree_batch (void **ptrs, size_t count, char* file, int line) {
+    Chunk *chunk = NULL; // chunk a pointer points into
+    size_t size = 0; // user data block size
+    size_t kept = 0; // pointers left to free, moved to the front of ptrs
 
-    /* edge case where user inputted pointer is outside of memory bounds */
-    if (((unsigned long) ptr <= (unsigned long) addressZero) || ((unsigned long) ptr >= ((unsigned long) addressZero + (unsigned long) MYBLOCK_SIZE))) {
-        printf("Free Error: User attempted to free pointer outside of memory block in file: %s on line: %d\n", file, line);
+    if (ptrs == NULL) {
         return;
     }
 
-    head = (MetaData*) myblock; // pointing head pointer of MetaData linked list to 0th index of myblock
-    curr = head;
-    while (curr != NULL) {
-        if ((curr + 1) == ptr) { // valid pointer found, but blockstatus needs to be checked
-            if (curr->blockstatus == 'U') { // if current user data block is being used, then make it free
-                curr->blockstatus = 'F';
-                return;
-            } else if (curr->blockstatus == 'F') { // valid pointer found, but it is already a free user data block
-                printf("Free Error: User attempted to free pointer to already free user data block in file: %s line: %d\n", file, line);
-                return;
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i] != NULL && !checkPointer(ptrs[i], "Free", "free", file, line, &chunk, &size)) {
+            ptrs[i] = NULL;
+        }
+    }
+    sortPointers(ptrs, count);
+
+    /* sorting put the same pointer given twice next to itself; the sweep below must see neither holes nor repeats */
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        } else if (kept > 0 && ptrs[i] == ptrs[kept - 1]) {
+            reportError("Free Error: User attempted to free pointer to already free user data block in file: %s line: %d\n", file, line);
+            ptrs[i] = NULL;
+            continue;
+        }
+        ptrs[kept] = ptrs[i];
+        if (i != kept) {
+            ptrs[i] = NULL;
+        }
+
+        chunk = chunkOf(ptrs[kept]);
+        size = (chunk->kind == 'S') ? chunk->objectsize : blockLength(((MetaData*) ptrs[kept]) - 1);
+        statsUpdate(-(long long) size);
+        if (__atomic_load_n(&observers, __ATOMIC_RELAXED)) {
+            observe(TRACE_FREE, file, line, ptrs[kept], size, 0);
+        }
+        kept++;
+    }
+
+    releaseSorted(ptrs, kept);
+}
+
+/**
+ * Tries to resize a heap chunk user data block without moving it: shrinking splits off the tail, and
+ * growing absorbs the physically next block if it is free and large enough. Caller must hold heaplock.
+ * @param[in] used MetaData node
+ * @param[in] new size (already rounded up)
+ * @param[out] 1 if the block now holds at least size bytes, 0 if it has to move
+ */
+static int heapResize (MetaData *node, unsigned int size) {
+    MetaData *next = NULL;
+
+    if (size > blockLength(node)) {
+        next = nextBlock(node);
+        if (next == NULL || isUsed(next) || blockLength(node) + METADATA_SIZE + blockLength(next) < size) {
+            return 0;
+        }
+
+        binRemove(next);
+        clearBlockStart(chunkOf(next), next);
+        setBlockLength(node, blockLength(node) + METADATA_SIZE + blockLength(next));
+        updateBoundaryTag(node);
+    }
+
+    splitBlock(node, size); // hands back whatever is left beyond size
+    return 1;
+}
+
+/**
+ * myrealloc() is a better version of realloc() that does not allow the user to do Bad Things. Resizes a
+ * user data block handed out by mymalloc(), keeping its contents. The block stays where it is whenever
+ * possible: a heap block shrinks in place by splitting off its tail and grows into a free block right after
+ * it, a large mapping shrinks by unmapping the pages past its new end, and a slab object keeps its size when
+ * shrinking. Anything else is copied to a new block, including a large mapping shrinking below MMAP_THRESHOLD,
+ * which moves to a heap block or slab object.
+ * @param[in] pointer to user data block to be resized, or NULL to behave like mymalloc()
+ * @param[in] new user requested size, or 0 to behave like myfree()
+ * @param[in] file wherein user called realloc, to report errors if an invalid call occurred
+ * @param[in] line number from file wherein user called realloc, to report errors if an invalid call occurred
+ * @param[out] void* pointer to start address of the resized user data block, or NULL if it could not be resized
+ */
+void* myrealloc (void* ptr, size_t size, char* file, int line) {
+    Chunk *chunk = NULL; // chunk ptr points into
+    size_t oldsize = 0; // current user data block size
+    void *newptr = NULL; // user data block the contents move to, as a last resort
+    int resized = 0;
+
+    if (ptr == NULL) {
+        return mymalloc(size, file, line);
+    }
+    if (size == 0) {
+        myfree(ptr, file, line);
+        return NULL;
+    }
+
+    if (!checkPointer(ptr, "Realloc", "realloc", file, line, &chunk, &oldsize)) {
+        return NULL;
+    }
+
+    if (size <= MAX_REQUEST_SIZE) {
+        if (chunk->kind == 'H') {
+            pthread_mutex_lock(&heaplock);
+            resized = heapResize(((MetaData*) ptr) - 1, (unsigned int) ((size <= SLAB_MAX_SIZE) ? MIN_HEAP_BLOCK : BLOCK_SIZE(size)));
+            pthread_mutex_unlock(&heaplock);
+            if (resized) {
+                statsResize(oldsize, blockLength(((MetaData*) ptr) - 1));
+            }
+        } else if (chunk->kind == 'L') {
+            resized = (size <= oldsize && BLOCK_SIZE(size) >= MMAP_THRESHOLD);
+            if (resized) {
+                largeShrink(chunk, BLOCK_SIZE(size));
+                statsResize(oldsize, blockLength(((MetaData*) ptr) - 1));
             }
         } else {
-            curr = curr->next;
+            resized = (size <= oldsize); // slab objects keep their size when shrinking
+        }
+        if (resized) {
+            if (__atomic_load_n(&observers, __ATOMIC_RELAXED)) {
+                observe(TRACE_REALLOC, file, line, ptr, size, (uint64_t) (uintptr_t) ptr);
+            }
+            return ptr;
         }
     }
 
-    printf("Free Error: User attempted to free invalid pointer in file: %s line: %d\n", file, line);
-    return;
+    newptr = allocate(size, file, line); // also reports sizes that are too large
+    if (newptr == NULL) {
+        return NULL; // like realloc(), the old block is left untouched
+    }
+
+    if (__atomic_load_n(&observers, __ATOMIC_RELAXED)) {
+        observe(TRACE_REALLOC, file, line, newptr, size, (uint64_t) (uintptr_t) ptr);
+    }
+    memcpy(newptr, ptr, (oldsize < size) ? oldsize : size);
+    release(ptr, chunk, oldsize);
+    return newptr;
+}
+
+/**
+ * Reports one inconsistency found by mymalloc_check().
+ * @param[in] what is wrong
+ * @param[in] address it was found at
+ * @param[out] 1, for the caller to add to its count
+ */
+static int checkFailed (const char *problem, const void *addr) {
+#ifdef MYMALLOC_NO_DIAGNOSTICS
+    (void) problem;
+    (void) addr;
+#endif
+    reportError("Heap Check Error: %s at address: %lu\n", problem, (unsigned long) (uintptr_t) addr);
+    return 1;
+}
+
+/**
+ * Walks the MetaData linked list of one heap chunk, from its first node to its fence. Caller must hold heaplock.
+ * @param[in] heap chunk
+ * @param[in] where the bytes of its free blocks are added
+ * @param[in] where the number of its free blocks is added
+ * @param[out] number of problems found
+ */
+static int heapCheckChunk (Chunk *chunk, size_t *freebytes, size_t *freeblocks) {
+    MetaData *node = chunk->first;
+    unsigned int info = 0;
+    unsigned int length = 0;
+    int prevused = 1; // the first node has nothing before it
+    size_t nodes = 0;
+    size_t starts = 0; // bits set in the block start bitmap
+    int problems = 0;
+
+    if (chunkOf(chunk->first) != chunk || chunkOf(chunk->end) != chunk) {
+        problems += checkFailed("Heap chunk missing from the page map", chunk->first);
+    }
+
+    while ((char*) node < chunk->end) {
+        info = blockInfo(node);
+        length = info & ~BLOCK_FLAGS;
+        if (node->checksum != blockChecksum(node, info)) {
+            problems += checkFailed("MetaData node with a bad checksum", node);
+        }
+        if (!isBlockStart(chunk, node)) {
+            problems += checkFailed("MetaData node missing from the block start bitmap", node);
+        }
+        if (length < MIN_BLOCK_SIZE || (length + METADATA_SIZE) % SIZE_GRANULE != 0 || (char*) (node + 1) + length > chunk->end) {
+            return problems + checkFailed("MetaData node with an impossible block length", node); // the rest of the list cannot be found
+        }
+        if (((info & PREV_USED) != 0) != prevused) {
+            problems += checkFailed("MetaData node with an out of date PREV_USED bit", node);
+        }
+        if (!(info & BLOCK_USED)) {
+            if (!prevused) {
+                problems += checkFailed("Free block next to another free block", node);
+            }
+            if (FOOTER((char*) (node + 1) + length) != length) {
+                problems += checkFailed("Free block whose footer does not match its length", node);
+            }
+            *freebytes += length;
+            (*freeblocks)++;
+        }
+
+        prevused = (info & BLOCK_USED) != 0;
+        nodes++;
+        node = (MetaData*) ((char*) (node + 1) + length);
+    }
+
+    // block lengths plus their MetaData have to add up to the chunk, ending right at the fence
+    if ((char*) node != chunk->end) {
+        problems += checkFailed("Blocks that do not add up to their heap chunk", node);
+    }
+    if (blockInfo(node) != BLOCK_USED) {
+        problems += checkFailed("Overwritten fence node", node);
+    }
+
+    for (size_t i = 0; i < (size_t) (chunk->end - (char*) chunk->first) / SIZE_GRANULE / 8 + 1; i++) {
+        starts += __builtin_popcount(chunk->blockstarts[i]);
+    }
+    if (starts != nodes) {
+        problems += checkFailed("Block start bitmap marking addresses that hold no MetaData node", chunk->first);
+    }
+
+    return problems;
+}
+
+/**
+ * Checks that the heap is consistent: every heap chunk is walked node by node, checking checksums, boundary tags
+ * and that the blocks add up to the chunk with no two free ones side by side; every bin is walked checking its
+ * links, and that it holds exactly the free blocks the walk found; every slab's counts are checked against its
+ * occupancy bitmap. Large mappings are not kept in any list and are only checked when freed. Each problem is
+ * reported like any other error. Holds heaplock throughout, so it is meant for tests and debugging.
+ * @param[out] number of problems found, 0 if the heap is consistent
+ */
+int mymalloc_check () {
+    Chunk *chunk = NULL;
+    Chunk *prevchunk = NULL;
+    MetaData *curr = NULL;
+    MetaData *prev = NULL;
+    size_t walkbytes = 0; // free heap blocks found walking the heap chunks
+    size_t walkblocks = 0;
+    size_t listedbytes = 0; // free heap blocks found walking the bins
+    size_t listedblocks = 0;
+    size_t slabbytes = 0;
+    unsigned int slabcount = 0;
+    unsigned int inuse = 0; // occupancy bits set in one slab
+    int full = 0; // whether a full slab came up in a slab list
+    int problems = 0;
+
+    heapEnsureReady();
+    pthread_mutex_lock(&heaplock);
+
+    for (chunk = heapchunks; chunk != NULL; prevchunk = chunk, chunk = chunk->nextchunk) {
+        if (chunk->prevchunk != prevchunk || chunk->kind != 'H') {
+            problems += checkFailed("Broken list of heap chunks", chunk);
+            break;
+        }
+        problems += heapCheckChunk(chunk, &walkbytes, &walkblocks);
+    }
+
+    for (unsigned int index = 0; index < NUM_BINS; index++) {
+        if ((bins[index] != NULL) != ((binmap >> index) & 1)) {
+            problems += checkFailed("Bin map out of date", &bins[index]);
+        }
+        prev = NULL;
+        for (curr = bins[index]; curr != NULL; prev = curr, curr = LINKS(curr)->nextfree) {
+            chunk = chunkOf(curr);
+            if (chunk == NULL || chunk->kind != 'H' || !isBlockStart(chunk, curr) || isUsed(curr)) {
+                problems += checkFailed("Bin linking to something other than a free block", curr);
+                break;
+            }
+            if (LINKS(curr)->prevfree != prev || binIndex(blockLength(curr)) != index) {
+                problems += checkFailed("Free block with broken bin links", curr);
+            }
+            listedbytes += blockLength(curr);
+            if (++listedblocks > walkblocks + 1) { // a cycle, or blocks the walk did not find
+                break;
+            }
+        }
+    }
+    if (listedblocks != walkblocks || listedbytes != walkbytes || listedblocks != bincount || listedbytes != binbytes) {
+        problems += checkFailed("Bins not holding exactly the free heap blocks", bins);
+    }
+
+    for (unsigned int class = 0; class < NUM_SLAB_CLASSES; class++) {
+        prevchunk = NULL;
+        full = 0;
+        slabcount = 0;
+        for (chunk = slabs[class]; chunk != NULL; prevchunk = chunk, chunk = chunk->nextchunk) {
+            if (chunk->prevchunk != prevchunk || chunk->kind != 'S' || chunkOf(chunk) != chunk || chunk->objectsize != ((unsigned int) SLAB_MIN_SIZE << class)) {
+                problems += checkFailed("Broken list of slab chunks", chunk);
+                break;
+            }
+            inuse = 0;
+            for (unsigned int word = 0; word < (chunk->objectcount + 63) / 64; word++) {
+                inuse += __builtin_popcountll(chunk->occupancy[word]);
+            }
+            if (chunk->objectcount % 64 != 0 && (chunk->occupancy[chunk->objectcount / 64] >> (chunk->objectcount % 64)) != 0) {
+                problems += checkFailed("Slab occupancy bitmap marking objects past its end", chunk);
+            }
+            if (inuse != chunk->objectcount - chunk->freeobjects) {
+                problems += checkFailed("Slab whose free object count does not match its occupancy bitmap", chunk);
+            }
+            if (full && chunk->freeobjects != 0) {
+                problems += checkFailed("Slab with free objects behind a full one", chunk);
+            }
+            full |= (chunk->freeobjects == 0);
+            slabbytes += (size_t) chunk->freeobjects * chunk->objectsize;
+            slabcount++;
+        }
+        if (slabcount != slabcounts[class]) {
+            problems += checkFailed("Slab count out of date", &slabs[class]);
+        }
+    }
+    if (slabbytes != slabfreebytes) {
+        problems += checkFailed("Free slab bytes out of date", slabs);
+    }
+
+    pthread_mutex_unlock(&heaplock);
+    return problems;
 }
 
 /**
@@ -187,38 +3233,50 @@ void printMemory () {
 }
 
 /**
- * Linked list function to print contents of each MetaData block
+ * Linked list function to print contents of each MetaData block, one heap chunk at a time. It walks the whole
+ * heap holding heaplock, so it is meant for debugging; mymalloc_stats() is the way to watch a running program.
  */
 void printMetaData () {
-    MetaData *curr_ptr = (MetaData*) myblock;
+    MetaData *curr_ptr = NULL;
     MetaData *addressZero;
+    Chunk *chunk = NULL;
     int count = 0; // current MetaData node
 
-    if (curr_ptr == NULL) {
+    if (!heapready) {
         printf("Empty MetaData list");
     }
 
     printf("---------------------------------------\n");
     printf("MetaData size: %ld\n", METADATA_SIZE);
     
-    addressZero = (MetaData*) myblock; // taking first MetaData address, and then subtracting from current MetaData address to convert to 0 - 4095
-    printf("addressZero: %lu\n", (unsigned long) addressZero);
-    while (curr_ptr != NULL) {
-        printf("---------------------------------------\n");
+    pthread_mutex_lock(&heaplock);
+    for (chunk = heapchunks; chunk != NULL; chunk = chunk->nextchunk) {
+        addressZero = chunk->first; // taking first MetaData address, and then subtracting from current MetaData address to convert to an offset in the chunk
+        printf("=======================================\n");
+        printf("Heap chunk %s at addressZero: %lu\n", (chunk == &mainchunk) ? "myblock" : "(mapped)", (unsigned long) addressZero);
+        for (curr_ptr = chunk->first; curr_ptr != NULL; curr_ptr = nextBlock(curr_ptr)) {
+            printf("---------------------------------------\n");
 
-        printf("MetaData #%d at address: %lu\n", count, ((unsigned long) curr_ptr - (unsigned long) addressZero));
-        printf("Blockstatus: %c\n", curr_ptr->blockstatus);
-        printf("Blocklength: %d\n", curr_ptr->blocklength);
+            printf("MetaData #%d at address: %lu\n", count, ((unsigned long) curr_ptr - (unsigned long) addressZero));
+            printf("Blockstatus: %c\n", isUsed(curr_ptr) ? 'U' : 'F');
+            printf("Blocklength: %d\n", blockLength(curr_ptr));
+            printf("Previous blockstatus: %c\n", (curr_ptr == chunk->first) ? '-' : ((blockInfo(curr_ptr) & PREV_USED) ? 'U' : 'F'));
+            if (prevFreeBlock(curr_ptr) != NULL) {
+                printf("Previous blocklength: %d\n", FOOTER(curr_ptr));
+            }
 
-        if (curr_ptr->next == NULL) {
-            printf("Next MetaData block: %p\n", curr_ptr->next);
-        } else {
-            printf("Next MetaData block: %lu\n", ((unsigned long) curr_ptr->next - (unsigned long) addressZero));
+            count++;
         }
+    }
 
-        curr_ptr = curr_ptr->next;
-        count++;
+    for (unsigned int class = 0; class < NUM_SLAB_CLASSES; class++) {
+        for (chunk = slabs[class]; chunk != NULL; chunk = chunk->nextchunk) {
+            printf("=======================================\n");
+            printf("Slab chunk of %u byte objects at address: %lu, %u of %u objects in use\n", chunk->objectsize,
+                   (unsigned long) chunk->objects, chunk->objectcount - chunk->freeobjects, chunk->objectcount);
+        }
     }
+    pthread_mutex_unlock(&heaplock);
 
     printf("\n");
 }
\ No newline at end of file
@@ -3,15 +3,125 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #define malloc(x) mymalloc(x, __FILE__, __LINE__)
 #define free(x) myfree(x, __FILE__, __LINE__)
+#define aligned_alloc(a, x) myaligned_alloc(a, x, __FILE__, __LINE__)
+#define realloc(p, x) myrealloc(p, x, __FILE__, __LINE__)
+#define malloc_batch(x, n, ptrs) mymalloc_batch(x, n, ptrs, __FILE__, __LINE__)
+#define free_batch(ptrs, n) myfree_batch(ptrs, n, __FILE__, __LINE__)
 
-#define MYBLOCK_SIZE 4096
+#define MYBLOCK_SIZE 4096 // the first heap chunk, kept in the static myblock array
+#define CHUNK_SHIFT 16
+#define CHUNK_SIZE (1UL << CHUNK_SHIFT) // size and alignment of every further heap chunk, mapped with mmap
+#define MMAP_THRESHOLD (CHUNK_SIZE / 2) // requests at least this large get a dedicated mapping
+#define MAX_REQUEST_SIZE 0x7FFFFFFFUL // largest request accepted, so block lengths fit an unsigned int
 #define METADATA_SIZE sizeof(MetaData)
 
+#define SIZE_GRANULE 16 // user data addresses are kept at a multiple of this, and blocks grow in steps of it
+#define MIN_BLOCK_SIZE 24 // smallest user data block, large enough to hold the free list links and footer once freed
+#define SMALL_BIN_LIMIT 256 // blocks below this size get an exact-size bin
+#define NUM_SMALL_BINS (SMALL_BIN_LIMIT / SIZE_GRANULE)
+#define NUM_BINS 64 // small bins followed by one bin per power of two
+#define SLAB_MIN_SIZE 16 // smallest slab class, requests up to this size share it
+#define SLAB_MAX_SIZE 64 // requests up to this size are served from slabs with no MetaData
+#define NUM_SLAB_CLASSES 3 // slab classes of 16, 32 and 64 bytes
+#define METADATA_MAGIC 0x4D594D4Cu // 'MYML', mixed into every MetaData checksum
+#define TCACHE_COUNT 7 // most blocks a thread keeps cached per small bin
+#define TCACHE_REFILL 4 // blocks a thread grabs at once when its cache for a bin runs dry
+#define ARENA_REGION_SIZE CHUNK_SIZE // bytes an arena maps at a time, more for objects that do not fit
+
+/**
+ * Placement policies for picking a free heap block, see mymalloc_set_policy(). Best-fit is the default; build with
+ * -DMYMALLOC_DEFAULT_POLICY=MYMALLOC_FIRST_FIT or set MYMALLOC_POLICY=best|first|next to start with another.
+ */
+#define MYMALLOC_BEST_FIT 0 // smallest free block that fits
+#define MYMALLOC_FIRST_FIT 1 // free block that fits at the lowest address
+#define MYMALLOC_NEXT_FIT 2 // free block that fits at the lowest address after the last one carved, wrapping around
+
+#define STATS_CLASSES 16 // size classes counted by mymalloc_stats(): up to 16 bytes, up to 32, ..., and above 256KiB
+
+/**
+ * MallocStats is what mymalloc_stats() reports. Sizes are those of user data blocks, which can be a little
+ * larger than requested. allocs, frees and failures are counted per size class, see STATS_CLASSES.
+ */
+typedef struct MallocStats {
+    size_t inuse; // bytes handed out and not freed yet
+    size_t peakinuse; // highest inuse so far
+    size_t freebytes; // bytes in free heap blocks and free slab objects, not counting blocks held in thread caches
+    size_t largestfree; // largest free heap block, the largest request served without growing the heap
+    size_t usedblocks; // blocks handed out and not freed yet
+    size_t freeblocks; // free heap blocks
+    size_t footprint; // bytes the allocator holds, see mymalloc_footprint()
+    double fragmentation; // external fragmentation of the free heap blocks: 1 - largestfree / their total size
+    unsigned long long allocs[STATS_CLASSES];
+    unsigned long long frees[STATS_CLASSES];
+    unsigned long long failures[STATS_CLASSES]; // requests that could not be served, by requested size
+} MallocStats;
+
+/**
+ * Arena is a region objects are cut from one after the other and then all taken back at once, see arena_create().
+ */
+typedef struct Arena Arena;
+
+#define TRACE_MAGIC "MYMTRACE" // first bytes of every trace file
+#define TRACE_VERSION 1
+#define TRACE_MAX_FILES 256 // distinct source files a trace can name, later ones are recorded as TRACE_UNKNOWN_FILE
+#define TRACE_UNKNOWN_FILE 0xFFFF
+#define PROFILE_MAX_SITES 4096 // call sites the profiler tells apart, later ones are counted together as "(other sites)"
+#define PROFILE_LIFETIME_BUCKETS 8 // lifetimes below 1us, 10us, ..., 1s, and longer
+#define PROFILE_MAX_TOP 100 // most call sites a profile report lists
+#define PROFILE_DEFAULT_TOP 20 // call sites listed at exit when MYMALLOC_PROFILE is not a number
+
+/**
+ * A trace is a TraceHeader followed by TraceRecords in the order the calls happened. The first time a
+ * source file shows up, a TRACE_FILE record giving it an id is written first, followed by size bytes of
+ * its name (not null terminated); later records refer to the file by that id.
+ */
+typedef struct TraceHeader {
+    char magic[8]; // TRACE_MAGIC
+    uint32_t version; // TRACE_VERSION
+    uint32_t recordsize; // sizeof(TraceRecord)
+} TraceHeader;
+
+typedef struct TraceRecord {
+    uint8_t op; // one of the TRACE_ values below
+    uint8_t unused;
+    uint16_t file; // id of the source file making the call
+    uint32_t line; // line in that file
+    uint64_t ptr; // user data block handed out, freed or resized to
+    uint64_t size; // requested size
+    uint64_t extra; // TRACE_ALIGNED_ALLOC: alignment, TRACE_REALLOC: block before resizing
+} TraceRecord;
+
+#define TRACE_MALLOC 'M'
+#define TRACE_ALIGNED_ALLOC 'A'
+#define TRACE_FREE 'F'
+#define TRACE_REALLOC 'R'
+#define TRACE_FILE 'N'
+
 void* mymalloc(size_t, char*, int);
+void* myaligned_alloc(size_t, size_t, char*, int);
 void myfree(void*, char*, int);
+void* myrealloc(void*, size_t, char*, int);
+int mymalloc_batch(size_t, size_t, void**, char*, int);
+void myfree_batch(void**, size_t, char*, int);
+int mymalloc_trace_start(const char*);
+void mymalloc_trace_stop();
+size_t mymalloc_footprint();
+size_t mymalloc_usable_size(void*);
+MallocStats mymalloc_stats();
+int mymalloc_check();
+int mymalloc_set_policy(int);
+int mymalloc_policy();
+int mymalloc_profile_start(int);
+void mymalloc_profile_stop();
+void mymalloc_profile_report(int, int);
+Arena* arena_create();
+void* arena_alloc(Arena*, size_t);
+void arena_reset(Arena*);
+void arena_destroy(Arena*);
 void printMemory();
 void printMetaData();
 
@@ -0,0 +1,142 @@
+/**
+ * Assignment 1: ++Malloc (mymalloc_preload.c)
+ *
+ * @author Taran Suresh ts875
+ * @author Abhishek Naikoti an643
+ */
+
+/**
+ * The standard allocation functions on top of mymalloc(), built into libmymalloc.so with make libmymalloc.so.
+ * Preloading it replaces the C library's allocator in any dynamically linked program, no recompiling needed:
+ *     LD_PRELOAD=./libmymalloc.so program
+ * Errors are written to stderr. The standard functions do not know their caller, so errors, traces and
+ * profiles name PRELOAD_FILE instead.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "mymalloc.h"
+
+#undef malloc
+#undef free
+#undef aligned_alloc
+#undef realloc
+
+#define PRELOAD_FILE "(preloaded program)"
+
+/**
+ * malloc(0) has to hand out a block that can be freed, so empty requests get the smallest one.
+ */
+void* malloc (size_t size) {
+    void *ptr = mymalloc((size == 0) ? 1 : size, PRELOAD_FILE, 0);
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free (void *ptr) {
+    if (ptr != NULL) {
+        myfree(ptr, PRELOAD_FILE, 0);
+    }
+}
+
+void* calloc (size_t count, size_t size) {
+    size_t total = 0;
+    void *ptr = NULL;
+
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // mymalloc() rather than malloc(), which the compiler would turn this very function back into
+    ptr = mymalloc((total == 0) ? 1 : total, PRELOAD_FILE, 0);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    } else if (total < MMAP_THRESHOLD) { // larger blocks are fresh mappings, which the system already zeroed
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+void* realloc (void *ptr, size_t size) {
+    void *newptr = NULL;
+
+    if (ptr == NULL) {
+        return malloc(size);
+    } else if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    newptr = myrealloc(ptr, size, PRELOAD_FILE, 0);
+    if (newptr == NULL) {
+        errno = ENOMEM;
+    }
+    return newptr;
+}
+
+void* reallocarray (void *ptr, size_t count, size_t size) {
+    size_t total = 0;
+
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+void* aligned_alloc (size_t alignment, size_t size) {
+    void *ptr = NULL;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ptr = myaligned_alloc(alignment, (size == 0) ? 1 : size, PRELOAD_FILE, 0);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+int posix_memalign (void **memptr, size_t alignment, size_t size) {
+    void *ptr = NULL;
+
+    if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    ptr = myaligned_alloc(alignment, (size == 0) ? 1 : size, PRELOAD_FILE, 0);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/**
+ * Older aligned allocation functions some programs still call; a block from the C library's allocator
+ * would make free() report an invalid pointer.
+ */
+void* memalign (size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc (size_t size) {
+    return aligned_alloc((size_t) sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc (size_t size) {
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+
+    return aligned_alloc(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size (void *ptr) {
+    return mymalloc_usable_size(ptr);
+}